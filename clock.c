@@ -0,0 +1,135 @@
+/*
+Core clock bring-up: main oscillator -> PLL at the maximum rated frequency
+*/
+
+#include "common.h"
+#include "platform.h"
+#include "clock.h"
+#include "hw.h"
+
+OSTRUCT(fm3_crg_t, 0x40)
+OFIELD(0x00, u8 SCM_CTL);
+OFIELD(0x04, u8 SCM_STR);
+OFIELD(0x10, u8 BSC_PSR);
+OFIELD(0x14, u8 APBC0_PSR);
+OFIELD(0x18, u8 APBC1_PSR);
+OFIELD(0x1C, u8 APBC2_PSR);
+OFIELD(0x34, u8 PSW_TMR);
+OFIELD(0x38, u8 PLL_CTL1);
+OFIELD(0x3C, u8 PLL_CTL2);
+OSTRUCT_END
+
+OSTRUCT(fm3_usbclk_t, 0x04)
+OFIELD(0x00, u8 UCCR);
+OSTRUCT_END
+
+// flash interface FRWTR, kept here so the loader (stage1.c) can boost
+// without flash.c
+static vu32 *const flash_frwtr = (vu32 *)(FM3_FLASH_IF_BASE + 0x04);
+
+static volatile struct fm3_crg_t *const crg =
+    (struct fm3_crg_t * const)FM3_CRG_BASE;
+static volatile struct fm3_usbclk_t *const usbclk =
+    (struct fm3_usbclk_t * const)FM3_USBCLK_BASE;
+
+#define SCM_MOSCE (1 << 1)
+#define SCM_PLLE (1 << 4)
+#define SCM_MORDY (1 << 1)
+#define SCM_PLRDY (1 << 4)
+#define SCM_RC_SHIFT 5
+#define SCM_RC_MASK (7 << SCM_RC_SHIFT)
+#define SCM_RC_PLL (2 << SCM_RC_SHIFT)
+#define PSW_TMR_PINC (1 << 4) // PLL input is the high speed CR
+#define APBC_EN (1 << 7)
+#define APBC_DIV2 1
+#define UCCR_UCSEL (1 << 1) // usb clock derived from the main PLL
+
+// fPLLO = fosc / K * N, fVCO = fPLLO * M has to stay in 200-300MHz
+#define PLL_K 1
+#define PLL_M 3
+#define PLL_N (CLOCK_CORE_HZ / (CLOCK_MAIN_OSC_HZ / PLL_K))
+_Static_assert(CLOCK_CORE_HZ % (CLOCK_MAIN_OSC_HZ / PLL_K) == 0,
+               "core clock not reachable from the main oscillator");
+_Static_assert(PLL_N <= 64, "PLL N out of range");
+
+// above 60MHz flash reads need 2 wait cycles
+#define FLASH_WAIT_80MHZ 2
+
+// Sets FRWTR.RWT (flash read wait cycles), returns the previous setting
+static u32 flash_set_read_wait(u32 rwt) {
+  u32 old = *flash_frwtr;
+  *flash_frwtr = rwt;
+  // takes effect once read back
+  (void)*flash_frwtr;
+  return old;
+}
+
+static struct {
+  u8 boosted;
+  u8 scm_ctl;
+  u8 bsc_psr;
+  u8 apbc_psr[3];
+  u8 psw_tmr;
+  u8 pll_ctl1;
+  u8 pll_ctl2;
+  u32 flash_wait;
+} saved;
+
+static void clock_select(u8 rc) {
+  HW_WR8(&crg->SCM_CTL, (HW_RD8(&crg->SCM_CTL) & ~SCM_RC_MASK) | rc);
+  while ((HW_RD8(&crg->SCM_STR) & SCM_RC_MASK) != rc)
+    ;
+}
+
+// Only done if it can't disturb the usb link: the main oscillator has to
+// be running already and the usb clock must come from its own PLL.
+int clock_boost() {
+  u8 scm = HW_RD8(&crg->SCM_CTL);
+
+  if ((HW_RD8(&crg->SCM_STR) & SCM_RC_MASK) == SCM_RC_PLL)
+    return 0;
+  if (!(HW_RD8(&crg->SCM_STR) & SCM_MORDY) || (usbclk->UCCR & UCCR_UCSEL))
+    return 0;
+
+  saved.scm_ctl = scm;
+  saved.bsc_psr = crg->BSC_PSR;
+  saved.apbc_psr[0] = crg->APBC0_PSR;
+  saved.apbc_psr[1] = crg->APBC1_PSR;
+  saved.apbc_psr[2] = crg->APBC2_PSR;
+  saved.psw_tmr = crg->PSW_TMR;
+  saved.pll_ctl1 = crg->PLL_CTL1;
+  saved.pll_ctl2 = crg->PLL_CTL2;
+
+  // APB buses are limited to 40MHz
+  crg->BSC_PSR = 0;
+  crg->APBC0_PSR = APBC_DIV2;
+  crg->APBC1_PSR = APBC_EN | APBC_DIV2;
+  crg->APBC2_PSR = APBC_EN | APBC_DIV2;
+  saved.flash_wait = flash_set_read_wait(FLASH_WAIT_80MHZ);
+
+  crg->PSW_TMR &= ~PSW_TMR_PINC;
+  crg->PLL_CTL1 = ((PLL_K - 1) << 4) | (PLL_M - 1);
+  crg->PLL_CTL2 = PLL_N - 1;
+  HW_WR8(&crg->SCM_CTL, scm | SCM_PLLE);
+  while (!(HW_RD8(&crg->SCM_STR) & SCM_PLRDY))
+    ;
+  clock_select(SCM_RC_PLL);
+  saved.boosted = 1;
+  return 1;
+}
+
+void clock_restore() {
+  if (!saved.boosted)
+    return;
+  clock_select(saved.scm_ctl & SCM_RC_MASK);
+  HW_WR8(&crg->SCM_CTL, saved.scm_ctl);
+  crg->PLL_CTL1 = saved.pll_ctl1;
+  crg->PLL_CTL2 = saved.pll_ctl2;
+  crg->PSW_TMR = saved.psw_tmr;
+  crg->BSC_PSR = saved.bsc_psr;
+  crg->APBC0_PSR = saved.apbc_psr[0];
+  crg->APBC1_PSR = saved.apbc_psr[1];
+  crg->APBC2_PSR = saved.apbc_psr[2];
+  flash_set_read_wait(saved.flash_wait);
+  saved.boosted = 0;
+}
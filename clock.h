@@ -0,0 +1,19 @@
+#pragma once
+
+/*
+ Optional core clock boost (make CLOCK=1). The PLL is run from the main
+ oscillator at CLOCK_CORE_HZ for as long as the server is in charge; the
+ clock setup left by the ROM is put back before handing off.
+*/
+
+#ifndef CLOCK_MAIN_OSC_HZ
+#define CLOCK_MAIN_OSC_HZ 4000000
+#endif
+// MB9BF50x maximum
+#define CLOCK_CORE_HZ 80000000
+// all APB buses while boosted
+#define CLOCK_APB_HZ (CLOCK_CORE_HZ / 2)
+
+// nonzero if the core now runs at CLOCK_CORE_HZ
+int clock_boost();
+void clock_restore();
@@ -0,0 +1,41 @@
+#pragma once
+
+/*
+ Cortex-M3 core registers used for sleeping on peripheral events and
+ counting cycles
+*/
+
+#include "hw.h"
+
+OSTRUCT(cm3_nvic_t, 0x200)
+OFIELD(0x000, u32 ISER[8]);
+OFIELD(0x080, u32 ICER[8]);
+OFIELD(0x180, u32 ICPR[8]);
+OSTRUCT_END
+
+static volatile struct cm3_nvic_t *const nvic =
+    (struct cm3_nvic_t * const)0xE000E100;
+static vu32 *const scb_scr = (vu32 *)0xE000ED10;
+
+// interrupts becoming pending wake WFE, even while disabled in the NVIC
+#define SCR_SEVONPEND (1 << 4)
+
+#define NVIC_BIT(irqn) (1u << ((irqn)&31))
+
+OSTRUCT(cm3_dwt_t, 0x08)
+OFIELD(0x00, u32 CTRL);
+OFIELD(0x04, u32 CYCCNT);
+OSTRUCT_END
+
+static volatile struct cm3_dwt_t *const dwt =
+    (struct cm3_dwt_t * const)0xE0001000;
+static vu32 *const demcr = (vu32 *)0xE000EDFC;
+
+#define DEMCR_TRCENA (1 << 24)
+#define DWT_CTRL_CYCCNTENA 1
+
+// starts DWT.CYCCNT counting, if it isn't already
+static inline void cm3_cycles_enable() {
+  HW_WR32(demcr, HW_RD32(demcr) | DEMCR_TRCENA);
+  HW_WR32(&dwt->CTRL, HW_RD32(&dwt->CTRL) | DWT_CTRL_CYCCNTENA);
+}
@@ -6,14 +6,19 @@ typedef uint8_t u8;
 typedef uint16_t u16;
 typedef uint32_t u32;
 typedef uint64_t u64;
+typedef int32_t s32;
 
 typedef volatile u8 vu8;
 typedef volatile u16 vu16;
 typedef volatile u32 vu32;
 typedef volatile u64 vu64;
 
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
 #define CAT_(x, y) x##y
 #define CAT(x, y) CAT_(x, y)
+#define STR_(x) #x
+#define STR(x) STR_(x)
 
 #define OPAD(size) u8 CAT(_pad_, __COUNTER__)[size]
 #define OSTRUCT(name, size)                                                    \
@@ -31,8 +36,14 @@ typedef volatile u64 vu64;
     field;                                                                     \
   }
 
+#ifdef HOST_SIM
+// pointers are wider on the host, ROM layouts only matter on target
+#define ASSERT_STRSIZE(struc, size) struct CAT(_assert_, __COUNTER__)
+#define ASSERT_STROFF(struc, member, offset) struct CAT(_assert_, __COUNTER__)
+#else
 #define ASSERT_STRSIZE(struc, size)                                            \
   _Static_assert(sizeof(struc) == (size), "size of " #struc " != " #size)
 #define ASSERT_STROFF(struc, member, offset)                                   \
   _Static_assert(offsetof(struc, member) == (offset),                          \
                  "offset of " #struc "." #member " != " #offset)
+#endif
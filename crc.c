@@ -0,0 +1,52 @@
+/*
+CRC-32 using the CRC unit
+*/
+
+#include "common.h"
+#include "platform.h"
+#include "crc.h"
+#include "hw.h"
+
+OSTRUCT(fm3_crc_t, 0x10)
+OFIELD(0x00, u8 CRCCR);
+OFIELD(0x04, u32 CRCINIT);
+OFIELD(0x08, u32 CRCIN);
+OFIELD(0x0C, u32 CRCR);
+OSTRUCT_END
+
+static volatile struct fm3_crc_t *const crc_unit =
+    (struct fm3_crc_t * const)FM3_CRC_BASE;
+
+#define CRCCR_INIT (1 << 0)
+#define CRCCR_CRC32 (1 << 1)
+#define CRCCR_LTLEND (1 << 2) // words are fed lowest byte first
+#define CRCCR_LSBFST (1 << 3) // reflected input
+#define CRCCR_CRCLSF (1 << 5) // reflected output
+#define CRCCR_FXOR (1 << 6)
+
+void crc32_start() {
+  crc_unit->CRCINIT = 0xffffffff;
+  HW_WR8(&crc_unit->CRCCR, CRCCR_INIT | CRCCR_CRC32 | CRCCR_LTLEND |
+                               CRCCR_LSBFST | CRCCR_CRCLSF | CRCCR_FXOR);
+}
+
+void crc32_update(const u8 *buf, u32 len) {
+  vu8 *in8 = (vu8 *)&crc_unit->CRCIN;
+
+  while (((u32)buf & 3) && len) {
+    HW_WR8(in8, *buf++);
+    len--;
+  }
+  for (; len >= 4; len -= 4, buf += 4)
+    HW_WR32(&crc_unit->CRCIN, *(const u32 *)buf);
+  while (len--)
+    HW_WR8(in8, *buf++);
+}
+
+u32 crc32_result() { return HW_RD32(&crc_unit->CRCR); }
+
+u32 crc32(const u8 *buf, u32 len) {
+  crc32_start();
+  crc32_update(buf, len);
+  return crc32_result();
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+// CRC-32 as computed by zlib.crc32() on the host
+void crc32_start();
+void crc32_update(const u8 *buf, u32 len);
+u32 crc32_result();
+u32 crc32(const u8 *buf, u32 len);
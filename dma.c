@@ -0,0 +1,51 @@
+/*
+Software triggered block transfers on the DMAC
+*/
+
+#include "common.h"
+#include "platform.h"
+#include "dma.h"
+
+#define DMAC_NUM_CHANNELS 8
+
+struct fm3_dmac_ch_t {
+  u32 DMACA;
+  u32 DMACB;
+  u32 DMACSA;
+  u32 DMACDA;
+};
+
+OSTRUCT(fm3_dmac_t, 0x90)
+OFIELD(0x00, u32 DMACR);
+OFIELD(0x10, struct fm3_dmac_ch_t ch[DMAC_NUM_CHANNELS]);
+OSTRUCT_END
+
+static volatile struct fm3_dmac_t *const dmac =
+    (struct fm3_dmac_t * const)FM3_DMAC_BASE;
+
+#define DMACR_DE (1u << 31)
+#define DMACA_EB (1u << 31)
+#define DMACA_ST (1 << 29)
+#define DMACB_SS_MASK (7 << 16)
+#define DMACB_SS_DONE (5 << 16)
+
+// count is in units of the transfer width, up to 0x10000
+void dma_start(u32 ch, const volatile void *src, volatile void *dst, u32 count,
+               u32 flags) {
+  volatile struct fm3_dmac_ch_t *c = &dmac->ch[ch];
+  dmac->DMACR = DMACR_DE;
+  c->DMACA = 0;
+  c->DMACSA = (u32)src;
+  c->DMACDA = (u32)dst;
+  // block mode, one transfer per block; also clears the stop status
+  c->DMACB = flags;
+  // input select 0 is the software request
+  c->DMACA = DMACA_EB | DMACA_ST | (count - 1);
+}
+
+int dma_poll(u32 ch) {
+  u32 ss = dmac->ch[ch].DMACB & DMACB_SS_MASK;
+  if (!ss)
+    return DMA_BUSY;
+  return ss == DMACB_SS_DONE ? DMA_DONE : DMA_ERROR;
+}
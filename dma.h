@@ -0,0 +1,17 @@
+#pragma once
+
+// dma_start flags
+#define DMA_WIDTH_8 (0 << 26)
+#define DMA_WIDTH_16 (1 << 26)
+#define DMA_WIDTH_32 (2 << 26)
+#define DMA_FIXED_SRC (1 << 25)
+#define DMA_FIXED_DST (1 << 24)
+
+// dma_poll results
+#define DMA_BUSY 0
+#define DMA_DONE 1
+#define DMA_ERROR -1
+
+void dma_start(u32 ch, const volatile void *src, volatile void *dst, u32 count,
+               u32 flags);
+int dma_poll(u32 ch);
@@ -0,0 +1,169 @@
+/*
+Flash programming through the flash interface (CPU programming mode)
+*/
+
+#include "common.h"
+#include "platform.h"
+#include "flash.h"
+#include "hw.h"
+#include "sp_xfer.h"
+
+OSTRUCT(fm3_flash_if_t, 0x14)
+OFIELD(0x00, u32 FASZR);
+OFIELD(0x04, u32 FRWTR);
+OFIELD(0x08, u32 FSTR);
+OFIELD(0x10, u32 FSYNDN);
+OSTRUCT_END
+
+static volatile struct fm3_flash_if_t *const flash_if =
+    (struct fm3_flash_if_t * const)FM3_FLASH_IF_BASE;
+
+#define FASZR_ASZ_16 1
+#define FASZR_ASZ_32 2
+#define FSTR_RDY 1
+
+// Command sequences must be issued with 16bit accesses
+#define FLASH_SEQ_ADDR1 0x1550
+#define FLASH_SEQ_ADDR2 0x0AA8
+#define FLASH_CMD_UNLOCK1 0xAA
+#define FLASH_CMD_UNLOCK2 0x55
+#define FLASH_CMD_PROGRAM 0xA0
+#define FLASH_CMD_ERASE 0x80
+#define FLASH_CMD_ERASE_CHIP 0x10
+#define FLASH_CMD_ERASE_SECTOR 0x30
+#define FLASH_CMD_RESET 0xF0
+
+// Hardware sequence flags, read back from the busy address
+#define FLASH_DQ5 (1 << 5) // timing limit exceeded
+#define FLASH_DQ6 (1 << 6) // toggle
+
+// MB9BF50x layout: SA0-SA3 are 8KiB, SA4 96KiB, the rest 128KiB
+static const u32 flash_sectors[] = {
+    0x00000, 0x02000, 0x04000, 0x06000, 0x08000, 0x20000, FLASH_SIZE,
+};
+
+static vu16 *flash_ptr(u32 addr) { return (vu16 *)(FM3_FLASH_BASE + addr); }
+
+static void flash_set_access_size(u32 asz) {
+  flash_if->FASZR = asz;
+  // setting only takes effect once read back
+  (void)flash_if->FASZR;
+}
+
+static void flash_cmd(u32 addr, u16 val) { HW_WR16(flash_ptr(addr), val); }
+
+static void flash_unlock() {
+  flash_cmd(FLASH_SEQ_ADDR1, FLASH_CMD_UNLOCK1);
+  flash_cmd(FLASH_SEQ_ADDR2, FLASH_CMD_UNLOCK2);
+}
+
+// Toggle bit polling. The transport keeps getting serviced so that the
+// host can continue streaming while the flash is busy.
+static int flash_wait(u32 addr) {
+  vu16 *p = flash_ptr(addr);
+  for (;;) {
+    u16 a = HW_RD16(p);
+    u16 b = HW_RD16(p);
+    if (!((a ^ b) & FLASH_DQ6))
+      break;
+    if (b & FLASH_DQ5) {
+      a = HW_RD16(p);
+      b = HW_RD16(p);
+      if (!((a ^ b) & FLASH_DQ6))
+        break;
+      flash_cmd(0, FLASH_CMD_RESET);
+      return -1;
+    }
+    sp_poll();
+  }
+  while (!(flash_if->FSTR & FSTR_RDY))
+    sp_poll();
+  return 0;
+}
+
+static int flash_erase_seq(u32 addr, u16 cmd) {
+  flash_unlock();
+  flash_cmd(FLASH_SEQ_ADDR1, FLASH_CMD_ERASE);
+  flash_unlock();
+  flash_cmd(addr, cmd);
+  return flash_wait(addr);
+}
+
+int flash_sector(u32 addr, u32 *beg, u32 *end) {
+  u32 i;
+  addr -= FM3_FLASH_BASE;
+  if (addr >= FLASH_SIZE)
+    return -1;
+  for (i = 0; addr >= flash_sectors[i + 1]; i++)
+    ;
+  *beg = FM3_FLASH_BASE + flash_sectors[i];
+  *end = FM3_FLASH_BASE + flash_sectors[i + 1];
+  return 0;
+}
+
+static int flash_blank_check(u32 addr, u32 len) {
+  vu32 *p = (vu32 *)(FM3_FLASH_BASE + (addr & ~3));
+  vu32 *end = (vu32 *)(FM3_FLASH_BASE + addr + len);
+  for (; p < end; p++) {
+    if (*p != 0xffffffff)
+      return -1;
+  }
+  return 0;
+}
+
+// len == 0 erases the whole chip, otherwise every sector overlapping
+// [addr, addr + len) is erased.
+int flash_erase(u32 addr, u32 len) {
+  int rv = 0;
+  u32 i;
+
+  addr = len ? addr - FM3_FLASH_BASE : 0;
+  if (addr >= FLASH_SIZE || len > FLASH_SIZE - addr)
+    return -1;
+
+  flash_set_access_size(FASZR_ASZ_16);
+  if (!len) {
+    rv = flash_erase_seq(FLASH_SEQ_ADDR1, FLASH_CMD_ERASE_CHIP);
+    len = FLASH_SIZE;
+  } else {
+    for (i = 0; !rv && i < ARRAY_SIZE(flash_sectors) - 1; i++) {
+      u32 beg = flash_sectors[i];
+      u32 end = flash_sectors[i + 1];
+      if (beg >= addr + len || end <= addr)
+        continue;
+      rv = flash_erase_seq(beg, FLASH_CMD_ERASE_SECTOR);
+    }
+  }
+  flash_set_access_size(FASZR_ASZ_32);
+
+  if (!rv)
+    rv = flash_blank_check(addr, len);
+  return rv;
+}
+
+// Halfwords which are already erased (0xffff) are skipped.
+int flash_program(u32 addr, const u8 *buf, u32 len) {
+  int rv = 0;
+
+  addr -= FM3_FLASH_BASE;
+  if ((addr | len) & 1)
+    return -1;
+  if (addr >= FLASH_SIZE || len > FLASH_SIZE - addr)
+    return -1;
+
+  flash_set_access_size(FASZR_ASZ_16);
+  for (; len; addr += 2, buf += 2, len -= 2) {
+    u16 val = buf[0] | (buf[1] << 8);
+    if (val == 0xffff)
+      continue;
+    flash_unlock();
+    flash_cmd(FLASH_SEQ_ADDR1, FLASH_CMD_PROGRAM);
+    flash_cmd(addr, val);
+    if (flash_wait(addr) || HW_RD16(flash_ptr(addr)) != val) {
+      rv = -1;
+      break;
+    }
+  }
+  flash_set_access_size(FASZR_ASZ_32);
+  return rv;
+}
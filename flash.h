@@ -0,0 +1,10 @@
+#pragma once
+
+// Matches the flash region in sram_code.ld, which starts at FM3_FLASH_BASE.
+// Addresses passed in are absolute.
+#define FLASH_SIZE 0x40000
+
+int flash_erase(u32 addr, u32 len);
+int flash_program(u32 addr, const u8 *buf, u32 len);
+// Bounds of the sector holding addr, returns -1 if it isn't flash
+int flash_sector(u32 addr, u32 *beg, u32 *end);
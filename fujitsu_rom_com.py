@@ -1,9 +1,16 @@
+import os
 import sys
+import mmap
+import time
 import struct
 import code
 import serial
+import zlib
 import binascii
 import argparse
+import threading
+import collections
+import concurrent.futures
 
 
 def fmt_from_size(size):
@@ -16,6 +23,260 @@ def fmt_from_size(size):
     return None
 
 
+def _lz4_len(out, n):
+    while n >= 255:
+        out.append(255)
+        n -= 255
+    out.append(n)
+
+
+def _lz4_seq(out, lit, off=0, mlen=0):
+    mlen = mlen - 4 if off else 0
+    out.append((min(len(lit), 15) << 4) | min(mlen, 15))
+    if len(lit) >= 15:
+        _lz4_len(out, len(lit) - 15)
+    out += lit
+    if off:
+        out += struct.pack('<H', off)
+        if mlen >= 15:
+            _lz4_len(out, mlen - 15)
+
+
+def lz4_compress(buf):
+    # greedy LZ4 block compressor, keeps the format's end of block rules
+    out = bytearray()
+    table = {}
+    n = len(buf)
+    pos = anchor = 0
+    while pos < n - 12:
+        key = buf[pos:pos + 4]
+        cand = table.get(key)
+        table[key] = pos
+        if cand is None or pos - cand > 0xffff:
+            pos += 1
+            continue
+        mlen = 4
+        while pos + mlen < n - 5 and buf[cand + mlen] == buf[pos + mlen]:
+            mlen += 1
+        _lz4_seq(out, buf[anchor:pos], pos - cand, mlen)
+        pos += mlen
+        anchor = pos
+    _lz4_seq(out, buf[anchor:])
+    return bytes(out)
+
+
+class LzCache:
+    # raw -> compressed blocks, shared by RomCom instances writing the same
+    # data from several threads. Each block is compressed once, threads
+    # wanting one that is being compressed wait for it.
+    def __init__(s):
+        s.lock = threading.Lock()
+        s.blocks = {}
+
+    def get(s, raw, compress):
+        with s.lock:
+            f = s.blocks.get(raw)
+            mine = f is None
+            if mine:
+                f = s.blocks[raw] = concurrent.futures.Future()
+        if mine:
+            try:
+                f.set_result(compress(raw))
+            except BaseException as e:
+                f.set_exception(e)
+                raise
+        return f.result()
+
+
+class BatchValue:
+    # result of a batched read, valid once the batch has run
+    def __init__(s):
+        s.value = None
+
+
+class Batch:
+    OP_READ = 0
+    OP_WRITE = 1
+    OP_RMW = 2
+    OP_POLL = 3
+
+    def __init__(s, com):
+        s.com = com
+        s.ops = []
+        s.results = []
+        s.ok = None
+
+    def __enter__(s):
+        return s
+
+    def __exit__(s, exc_type, exc, tb):
+        if exc_type is None:
+            s.ok = s.com.run_batch(s)
+        return False
+
+    def _op(s, op, addr, size, *args):
+        d = struct.pack('<BBL', op, size, addr)
+        d += b''.join(struct.pack('<L', a) for a in args)
+        s.ops.append(d)
+
+    def read(s, addr, size):
+        v = BatchValue()
+        s.results.append(v)
+        s._op(s.OP_READ, addr, size)
+        return v
+
+    def write(s, addr, size, val): s._op(s.OP_WRITE, addr, size, val)
+
+    def rmw(s, addr, size, mask, val): s._op(s.OP_RMW, addr, size, mask, val)
+
+    def poll(s, addr, size, mask, val, timeout=100000):
+        # timeout is in poll iterations
+        s._op(s.OP_POLL, addr, size, mask, val, timeout)
+
+    def read8(s, addr): return s.read(addr, 1)
+
+    def read16(s, addr): return s.read(addr, 2)
+
+    def read32(s, addr): return s.read(addr, 4)
+
+    def write8(s, addr, val): s.write(addr, 1, val)
+
+    def write16(s, addr, val): s.write(addr, 2, val)
+
+    def write32(s, addr, val): s.write(addr, 4, val)
+
+
+class Pipeline:
+    # Keeps up to window tagged commands in flight instead of waiting for
+    # each ack. The server echoes the tag after the ack, which is used to
+    # match the completion to its request.
+    def __init__(s, com, window=8):
+        assert window <= 0x100
+        s.com = com
+        s.window = window
+        s.next_tag = 0
+        s.pending = collections.OrderedDict()
+        s.ok = True
+
+    def __enter__(s):
+        return s
+
+    def __exit__(s, exc_type, exc, tb):
+        if exc_type is None:
+            s.flush()
+        return False
+
+    def _submit(s, cmd, d, resp_len, on_done):
+        while len(s.pending) >= s.window:
+            s._complete()
+        tag = s.next_tag
+        s.next_tag = (tag + 1) & 0xff
+        s.pending[tag] = (cmd, resp_len, on_done)
+        s.com._send(struct.pack('<BB', s.com.CMD_TAG, tag) + d)
+
+    def _complete(s):
+        # server completes in order, so the oldest request says how much
+        # data precedes the ack
+        _, (_, resp_len, _) = next(iter(s.pending.items()))
+        d = s.com.dev.read(resp_len)
+        ack, tag = struct.unpack('<BB', s.com.dev.read(2))
+        if tag not in s.pending:
+            raise IOError('completion for unknown tag %02x' % (tag))
+        cmd, _, on_done = s.pending.pop(tag)
+        ok = ((ack & 0xf0) == (cmd & 0xf0) and
+              (ack & 0xf) == s.com.STATUS_OK)
+        s.ok &= ok
+        if on_done is not None:
+            on_done(ok, d)
+
+    def flush(s):
+        while s.pending:
+            s._complete()
+        return s.ok
+
+    def read(s, addr, size, on_done):
+        d = s.com._with_checksum(s.com.CMD_READ,
+                                 struct.pack('>LHH', addr, 0, size))
+        s._submit(s.com.CMD_READ, d, size, on_done)
+
+    def write(s, addr, buf, on_done=None):
+        d = s.com._with_checksum(s.com.CMD_WRITE,
+                                 struct.pack('>LHH', addr, 0, len(buf)) + buf)
+        s._submit(s.com.CMD_WRITE, d, 0, on_done)
+
+
+class Stats:
+    # mirrors struct stats_t
+    FIELDS = ('polls', 'rx_bytes', 'tx_bytes', 'rx_stalls', 'tx_stalls',
+              'ep0_wait_cycles', 'fifo_rd_cycles', 'fifo_wr_cycles',
+              'sleeps', 'xfer_errors')
+    NUM_CMDS = 16
+    HIST_BUCKETS = 8
+    CMD_OTHER = 0xff
+    CMD_FMT = '<QLLL%dHB3x' % (HIST_BUCKETS)
+    SIZE = 4 * len(FIELDS) + NUM_CMDS * struct.calcsize(CMD_FMT)
+
+    def __init__(s, d):
+        n = 4 * len(s.FIELDS)
+        s.__dict__.update(zip(s.FIELDS, struct.unpack('<%dL' % (len(s.FIELDS)), d[:n])))
+        s.cmds = []
+        for c in struct.iter_unpack(s.CMD_FMT, d[n:]):
+            cycles, count, max_cycles, nbytes = c[:4]
+            if count:
+                s.cmds.append((c[-1], count, cycles, max_cycles, nbytes,
+                               c[4:-1]))
+
+    @staticmethod
+    def bucket_limit(i):
+        # upper bound in cycles of histogram bucket i
+        return 1 << (10 + 2 * i)
+
+    def render(s):
+        names = {v: k[4:].lower() for k, v in vars(RomCom).items()
+                 if k.startswith('CMD_')}
+        names[s.CMD_OTHER] = 'other'
+        out = ['%-16s %d' % (k, getattr(s, k)) for k in s.FIELDS]
+        hist = ' '.join('%6s' % ('<%dK' % (s.bucket_limit(i) >> 10))
+                        for i in range(s.HIST_BUCKETS - 1)) + '   more'
+        out.append('%-16s %8s %12s %10s %10s  %s' %
+                   ('cmd', 'count', 'avg cycles', 'max', 'bytes', hist))
+        for cmd, count, cycles, max_cycles, nbytes, h in s.cmds:
+            out.append('%-16s %8d %12d %10d %10d  %s' %
+                       (names.get(cmd, '%02x' % (cmd)), count,
+                        cycles // count, max_cycles, nbytes,
+                        ' '.join('%6d' % (n) for n in h)))
+        return '\n'.join(out)
+
+
+class Module:
+    # A module loaded by RomCom.load_module(). The header (struct
+    # sp_module_t) gives its size, the GOT to rebase and the entry points.
+    MAGIC = 0x444f4d53
+    HDR_FMT = '<5L'
+
+    def __init__(s, com, image, base):
+        hdr = struct.calcsize(s.HDR_FMT)
+        magic, size, got_start, got_end, nfuncs = struct.unpack(
+            s.HDR_FMT, image[:hdr])
+        if magic != s.MAGIC or size < len(image):
+            raise ValueError('not a module')
+        s.com = com
+        s.base = base
+        s.funcs = struct.unpack('<%dL' % (nfuncs),
+                                image[hdr:hdr + 4 * nfuncs])
+        # .bss comes zeroed
+        img = bytearray(image) + bytes(size - len(image))
+        for pos in range(got_start, got_end, 4):
+            val = struct.unpack_from('<L', img, pos)[0]
+            struct.pack_into('<L', img, pos, val + base)
+        s.image = bytes(img)
+
+    def call(s, index, *args):
+        # entry point index of SP_MODULE(), with up to three args
+        assert len(args) <= 3
+        return s.com.call(s.base + s.funcs[index], s.com.api(), *args)
+
+
 class RomCom:
     # loaded code may optionally reconfigure this
     # fujitsu's provided code switches to 115200 for example
@@ -23,31 +284,112 @@ class RomCom:
     BR_SRAM = 115200
     CMD_WRITE = 0
     CMD_PING = 0x18
+    CMD_TAG = 0x19
+    # only understood by a UART=1 server
+    CMD_SET_BAUD = 0x1a
     CMD_READ = 0x20
     CMD_READV = 0x21
     CMD_WRITEV = 0x22
     CMD_EXEC = 0x23
+    CMD_WRITE_STREAM = 0x24
+    CMD_WRITE_COMPRESSED = 0x25
+    CMD_CALL = 0x26
+    CMD_API = 0x27
+    CMD_FLASH_ERASE = 0x30
+    CMD_FLASH_PROGRAM = 0x31
+    CMD_FLASH_HASH = 0x32
+    CMD_CRC = 0x40
+    CMD_BATCH = 0x50
+    BATCH_MAX_OPS = 0xffff
+    # only in images built with make STATS=1
+    CMD_STATS = 0x60
+    CMD_STATS_RESET = 0x61
+    CMD_MEM_FILL = 0x70
+    CMD_MEM_COPY = 0x71
+    CMD_MEM_COMPARE = 0x72
+    CMD_MEM_FIND = 0x73
+    # matches a single CMD_MEM_FIND returns at most
+    MEM_FIND_MAX = 256
+    CMD_CAPTURE = 0x80
+    CAPTURE_MAX_ADDRS = 16
     CMD_FINALIZE = 0xc0
     STATUS_OK = 1
     STATUS_NG = 2
     STATUS_UNK_CMD = 4
+    # READ/WRITE flags, only understood by our server
+    RW_FLAG_CRC = 1
     # for usb, rom hardcodes where it jumps to
     # for uart, jump target is last addr passed to CMD_WRITE
     USB_CODE_ENTRY = 0x20000000
+    # the server image ends below the ROM's data (rom_data in sram_code.ld)
+    SERVER_END = 0x20002e6c
+    FLASH_SIZE = 0x40000
+    # named ranges for dump
+    REGIONS = {
+        'flash': (0, 0x40000),
+        'sram0': (0x1fff8000, 0x8000),
+        'sram1': (0x20000000, 0x8000),
+    }
+    # where load_module() puts modules by default (sram0, which the
+    # server doesn't use)
+    MODULE_BASE = 0x1fff8000
+    MODULE_SIZE = 0x8000
+    # READ length is a u16
+    READ_MAX = 0xf000
+    # server side staging buffers used by CMD_WRITE_STREAM
+    STREAM_BLOCK = 1024
+    STREAM_NBUF = 2
+    # chip erase can take several seconds
+    FLASH_TIMEOUT = 30
+    # tried in order when negotiating with a UART=1 server
+    UART_BAUDS = (4000000, 2000000, 1000000, 500000, 250000, 115200)
 
     def _open_dev(s, path, baud_rate):
         s.path = path
         s.dev = serial.Serial(s.path, s.BR_ROM, timeout=1)
 
-    def __init__(s, path, debug=False):
+    def __init__(s, path, debug=False, uart=False, max_baud=None):
         s._open_dev(path, s.BR_ROM)
         s.dbg = debug
+        s.uart = uart
+        s.max_baud = max_baud or s.UART_BAUDS[0]
+        # LzCache, may be shared by several instances writing the same data
+        s.lz_cache = None
 
     def reopen_dev(s):
         # seems to work, so why not!
         # perhaps the USBVCOM driver is just lying to us...
         s.dev.close()
         s._open_dev(s.path, s.BR_SRAM)
+        if s.uart:
+            s.negotiate_baud(s.max_baud)
+
+    def uart_reset(s):
+        # a break puts the server back at the ROM's rate
+        s.dev.baudrate = s.BR_ROM
+        s.dev.send_break(0.05)
+        time.sleep(0.05)
+        s.dev.reset_input_buffer()
+
+    def set_baud(s, baud):
+        # acked at the old rate, the server switches once that went out
+        s._send(struct.pack('<BL', s.CMD_SET_BAUD, baud))
+        if not s._check_rv(s.CMD_SET_BAUD):
+            return False
+        s.dev.baudrate = baud
+        if s.try_ping():
+            return True
+        s.uart_reset()
+        return False
+
+    def negotiate_baud(s, max_baud):
+        # returns the rate the link ended up at
+        s.uart_reset()
+        for baud in s.UART_BAUDS:
+            if baud <= max_baud and s.set_baud(baud):
+                s.print('uart at %d baud' % (baud))
+                return baud
+        return s.BR_ROM
 
     def print(s, *args):
         if s.dbg:
@@ -65,9 +407,12 @@ class RomCom:
         s.print('read: %02x' % (d))
         return d
 
-    def _cmd_with_checksum(s, cmd, buf):
+    def _with_checksum(s, cmd, buf):
         d = struct.pack('>B', cmd) + buf
-        s._send(d + s._checksum(d))
+        return d + s._checksum(d)
+
+    def _cmd_with_checksum(s, cmd, buf):
+        s._send(s._with_checksum(cmd, buf))
 
     def _check_rv(s, cmd, check_cmd=True):
         rv = s.recv_u8()
@@ -98,19 +443,86 @@ class RomCom:
         except:
             return False
 
-    def read(s, addr, size):
-        d = struct.pack('>LHH', addr, 0, size)
+    def read(s, addr, size, crc=False):
+        flags = s.RW_FLAG_CRC if crc else 0
+        d = struct.pack('>LHH', addr, flags, size)
         s._cmd_with_checksum(s.CMD_READ, d)
         d = s.dev.read(size)
-        if not s._check_rv(s.CMD_READ):
+        ok = True
+        if crc:
+            ok = struct.unpack('<L', s.dev.read(4))[0] == zlib.crc32(d)
+            if not ok:
+                print('read crc mismatch')
+        if not s._check_rv(s.CMD_READ) or not ok:
             return b''
         return d
 
-    def write(s, addr, buf):
-        d = struct.pack('>LHH', addr, 0, len(buf)) + buf
+    def write(s, addr, buf, crc=False):
+        flags = s.RW_FLAG_CRC if crc else 0
+        d = struct.pack('>LHH', addr, flags, len(buf)) + buf
+        if crc:
+            d += struct.pack('<L', zlib.crc32(buf))
         s._cmd_with_checksum(s.CMD_WRITE, d)
         return s._check_rv(s.CMD_WRITE)
 
+    def crc(s, addr, size):
+        # CRC-32 (as zlib.crc32) of a target range, computed on target
+        d = struct.pack('<BLL', s.CMD_CRC, addr, size)
+        s._send(d)
+        crc = struct.unpack('<L', s.dev.read(4))[0]
+        if not s._check_rv_slow(s.CMD_CRC):
+            return None
+        return crc
+
+    def verify(s, addr, buf):
+        return s.crc(addr, len(buf)) == zlib.crc32(buf)
+
+    def write_stream(s, addr, buf, window=None):
+        # every block is acked once it is queued on the server, so only
+        # wait for acks when more than window blocks are outstanding
+        if window is None:
+            window = s.STREAM_NBUF
+        d = struct.pack('<BLL', s.CMD_WRITE_STREAM, addr, len(buf))
+        s._send(d)
+        pending = 0
+        ok = True
+        for pos in range(0, len(buf), s.STREAM_BLOCK):
+            while pending >= window:
+                ok &= s._check_rv(s.CMD_WRITE_STREAM)
+                pending -= 1
+            s._send(buf[pos:pos + s.STREAM_BLOCK])
+            pending += 1
+        while pending:
+            ok &= s._check_rv(s.CMD_WRITE_STREAM)
+            pending -= 1
+        return s._check_rv_slow(s.CMD_WRITE_STREAM) and ok
+
+    def write_compressed(s, addr, buf, sparse=False):
+        # with sparse, all 0xff blocks are not sent (nor written) at all
+        d = struct.pack('<BLL', s.CMD_WRITE_COMPRESSED, addr, len(buf))
+        nsent = 0
+        for pos in range(0, len(buf), s.STREAM_BLOCK):
+            raw = buf[pos:pos + s.STREAM_BLOCK]
+            if sparse and raw.count(0xff) == len(raw):
+                comp = b''
+            else:
+                comp = s._compress_block(bytes(raw))
+            d += struct.pack('<HH', len(raw), len(comp)) + comp
+            nsent += len(comp)
+        s.print('compressed %d -> %d bytes' % (len(buf), nsent))
+        s._send(d)
+        return s._check_rv_slow(s.CMD_WRITE_COMPRESSED)
+
+    @staticmethod
+    def _lz4_block(raw):
+        comp = lz4_compress(raw)
+        return raw if len(comp) >= len(raw) else comp
+
+    def _compress_block(s, raw):
+        if s.lz_cache is None:
+            return s._lz4_block(raw)
+        return s.lz_cache.get(raw, s._lz4_block)
+
     def finalize(s):
         # contents of this buffer are not actually used but
         # it must still have correct checksum
@@ -135,6 +547,28 @@ class RomCom:
             return False
         return True
 
+    def exec_staged(s, stage1_path, path):
+        # Only stage1.bin goes through the ROM, it then takes the server
+        # compressed over the fast transport and starts it
+        try:
+            if not s.exec_file(stage1_path):
+                return False
+            s.reopen_dev()
+            with open(path, 'rb') as f:
+                image = f.read()
+            if not s.write_compressed(s.USB_CODE_ENTRY, image):
+                return False
+            if not s.verify(s.USB_CODE_ENTRY, image):
+                return False
+            s.jump(s.USB_CODE_ENTRY)
+            if s.uart:
+                # the server starts out at the ROM's rate again
+                s.dev.flush()
+                s.dev.baudrate = s.BR_ROM
+            return s._check_rv(s.CMD_FINALIZE, False)
+        except:
+            return False
+
     def _read_v(s, addr, type_len):
         d = struct.pack('<BLB', s.CMD_READV, addr, type_len)
         s._send(d)
@@ -161,15 +595,370 @@ class RomCom:
 
     def write32(s, addr, val): return s._write_v(addr, 4, val)
 
+    def _check_rv_slow(s, cmd):
+        timeout = s.dev.timeout
+        s.dev.timeout = s.FLASH_TIMEOUT
+        try:
+            return s._check_rv(cmd)
+        finally:
+            s.dev.timeout = timeout
+
+    def flash_erase(s, addr=0, size=0):
+        # size == 0 erases the whole chip
+        d = struct.pack('<BLL', s.CMD_FLASH_ERASE, addr, size)
+        s._send(d)
+        return s._check_rv_slow(s.CMD_FLASH_ERASE)
+
+    def flash_program(s, addr, buf):
+        # the whole range goes in one command, server programs
+        # while the rest is still being received
+        if len(buf) & 1:
+            buf += b'\xff'
+        d = struct.pack('<BLL', s.CMD_FLASH_PROGRAM, addr, len(buf)) + buf
+        s._send(d)
+        return s._check_rv_slow(s.CMD_FLASH_PROGRAM)
+
+    def flash_image(s, addr, buf, verify=True, compress=True):
+        if not s.flash_erase(addr, len(buf)):
+            return False
+        if compress:
+            # sectors were just erased, so 0xff blocks can be skipped
+            if len(buf) & 1:
+                buf += b'\xff'
+            ok = s.write_compressed(addr, buf, sparse=True)
+        else:
+            ok = s.flash_program(addr, buf)
+        if not ok:
+            return False
+        return not verify or s.verify(addr, buf)
+
+    def flash_hashes(s, addr, size):
+        # [(addr, size, crc)] of every sector overlapping the range,
+        # clipped to it
+        s._send(struct.pack('<BLL', s.CMD_FLASH_HASH, addr, size))
+        count = s.recv_u8()
+        d = s.dev.read(count * 12)
+        if not s._check_rv_slow(s.CMD_FLASH_HASH):
+            return None
+        return list(struct.iter_unpack('<LLL', d))
+
+    def flash_delta(s, addr, buf, verify=True, progress=None):
+        # Like flash_image, but only the sectors whose content differs from
+        # buf are erased and programmed. Returns the number of bytes
+        # programmed, or None on failure. As with flash_image, parts of the
+        # first and last sector outside of buf are erased too if those
+        # sectors change. progress(done, total) is called with the bytes
+        # programmed so far.
+        if len(buf) & 1:
+            buf += b'\xff'
+        hashes = s.flash_hashes(addr, len(buf))
+        if hashes is None:
+            return None
+        # adjacent changed sectors go out as one range
+        runs = []
+        for sec_addr, size, crc in hashes:
+            pos = sec_addr - addr
+            if zlib.crc32(buf[pos:pos + size]) == crc:
+                continue
+            if runs and runs[-1][1] == pos:
+                runs[-1][1] = pos + size
+            else:
+                runs.append([pos, pos + size])
+        total = sum(end - beg for beg, end in runs)
+        done = 0
+        for beg, end in runs:
+            if not s.flash_erase(addr + beg, end - beg):
+                return None
+            if not s.write_compressed(addr + beg, buf[beg:end], sparse=True):
+                return None
+            done += end - beg
+            if progress is not None:
+                progress(done, total)
+        if verify and not s.verify(addr, buf):
+            return None
+        return total
+
+    def batch(s):
+        # with c.batch() as b:
+        #     b.write32(...)
+        #     v = b.read32(...)
+        # print(v.value)
+        return Batch(s)
+
+    def run_batch(s, b):
+        ops = b.ops
+        results = iter(b.results)
+        ok = True
+        for pos in range(0, len(ops), s.BATCH_MAX_OPS):
+            chunk = ops[pos:pos + s.BATCH_MAX_OPS]
+            nreads = sum(1 for op in chunk if op[0] == Batch.OP_READ)
+            s._send(struct.pack('<BH', s.CMD_BATCH, len(chunk)) +
+                    b''.join(chunk))
+            d = s.dev.read(nreads * 4 + 2)
+            vals = struct.unpack('<%dLH' % (nreads), d)
+            for v in vals[:-1]:
+                next(results).value = v
+            if not s._check_rv_slow(s.CMD_BATCH):
+                print('batch failed at op %d' % (pos + vals[-1]))
+                ok = False
+                break
+        return ok
+
+    def pipeline(s, window=8):
+        return Pipeline(s, window)
+
+    def read_pipelined(s, addr, size, chunk=0x1000, window=8):
+        out = bytearray(size)
+
+        def done_at(pos):
+            def done(ok, d):
+                out[pos:pos + len(d)] = d
+            return done
+
+        with s.pipeline(window) as p:
+            for pos in range(0, size, chunk):
+                p.read(addr + pos, min(chunk, size - pos), done_at(pos))
+        return bytes(out) if p.ok else b''
+
+    def write_pipelined(s, addr, buf, chunk=0x1000, window=8):
+        with s.pipeline(window) as p:
+            for pos in range(0, len(buf), chunk):
+                p.write(addr + pos, buf[pos:pos + chunk])
+        return p.ok
+
+    # read sizes dump() tries on its first reads, keeping the fastest
+    AUTOTUNE_CHUNKS = (0x400, 0x1000, 0x4000, 0x8000, 0xf000)
+
+    def dump(s, addr, size, path, chunk=None, retries=3):
+        # Streams [addr, addr + size) into path through a mmap. Chunks
+        # which already match on target (by CRC) are skipped, so rerunning
+        # an interrupted dump resumes it. Without chunk, the reads which
+        # have to happen anyway go through AUTOTUNE_CHUNKS once each, the
+        # rest uses the fastest of them.
+        mode = 'r+b' if os.path.exists(path) else 'w+b'
+        with open(path, mode) as f:
+            if os.fstat(f.fileno()).st_size != size:
+                f.truncate(size)
+            if not size:
+                return True
+            mm = mmap.mmap(f.fileno(), size)
+            try:
+                tuning = []
+                if chunk is None:
+                    tuning = [n for n in s.AUTOTUNE_CHUNKS
+                              if n <= min(size, s.READ_MAX)]
+                    chunk = tuning[0] if tuning else size
+                chunk = min(chunk, s.READ_MAX)
+                best = None
+                skipped = 0
+                pos = 0
+                t = time.perf_counter()
+                while pos < size:
+                    n = min(chunk, size - pos)
+                    for attempt in range(retries + 1):
+                        try:
+                            if s.crc(addr + pos, n) == zlib.crc32(
+                                    mm[pos:pos + n]):
+                                skipped += n
+                                break
+                            rt = time.perf_counter()
+                            d = s.read(addr + pos, n, crc=True)
+                            rt = time.perf_counter() - rt
+                            if len(d) == n:
+                                mm[pos:pos + n] = d
+                                if tuning and n == tuning[0]:
+                                    rate = n / rt
+                                    s.print('chunk %x: %d B/s' % (n, rate))
+                                    if best is None or rate > best[1]:
+                                        best = (n, rate)
+                                    tuning.pop(0)
+                                    chunk = tuning[0] if tuning else best[0]
+                                break
+                        except (IOError, struct.error,
+                                serial.SerialException):
+                            if attempt == retries:
+                                raise
+                            s.reopen_dev()
+                    else:
+                        print('failed to read %08x' % (addr + pos))
+                        return False
+                    pos += n
+                t = time.perf_counter() - t
+                print('dumped %d bytes (%d already present) in %.2fs' %
+                      (size, skipped, t))
+                return True
+            finally:
+                mm.flush()
+                mm.close()
+
+    def mem_fill(s, addr, size, pattern=b'\0'):
+        # pattern repeated over [addr, addr + size) on target, RAM only
+        d = struct.pack('<BLLH', s.CMD_MEM_FILL, addr, size, len(pattern))
+        s._send(d + pattern)
+        return s._check_rv_slow(s.CMD_MEM_FILL)
+
+    def mem_copy(s, dst, src, size):
+        # on target, a flash dst gets programmed (it must be erased)
+        s._send(struct.pack('<BLLL', s.CMD_MEM_COPY, dst, src, size))
+        return s._check_rv_slow(s.CMD_MEM_COPY)
+
+    def mem_compare(s, a, b, size):
+        # offset of the first differing byte, size if the ranges match
+        s._send(struct.pack('<BLLL', s.CMD_MEM_COMPARE, a, b, size))
+        pos = struct.unpack('<L', s.dev.read(4))[0]
+        if not s._check_rv_slow(s.CMD_MEM_COMPARE):
+            return None
+        return pos
+
+    def mem_find(s, addr, size, pattern, limit=None):
+        # addresses of (possibly overlapping) occurrences of pattern
+        found = []
+        pos = 0
+        while limit is None or len(found) < limit:
+            n = s.MEM_FIND_MAX
+            if limit is not None:
+                n = min(n, limit - len(found))
+            s._send(struct.pack('<BLLHH', s.CMD_MEM_FIND, addr + pos,
+                                size - pos, n, len(pattern)) + pattern)
+            count = struct.unpack('<H', s.dev.read(2))[0]
+            d = s.dev.read(count * 4)
+            if not s._check_rv_slow(s.CMD_MEM_FIND):
+                return None
+            offs = struct.unpack('<%dL' % (count), d)
+            found += [addr + pos + off for off in offs]
+            if count < n:
+                break
+            pos += offs[-1] + 1
+        return found
+
+    def capture(s, addrs, period, size=4, count=None, duration=None,
+                on_data=None):
+        # Samples addrs every period core cycles on target, streaming the
+        # samples back until count samples arrived or duration seconds
+        # passed. Samples are tuples of one value per address, passed to
+        # on_data as they arrive if given, returned otherwise. Returns
+        # (samples, {'samples', 'dropped', 'late'}) or None.
+        assert 0 < len(addrs) <= s.CAPTURE_MAX_ADDRS and period > 0
+        rec_fmt = '<%d%s' % (len(addrs), fmt_from_size(size))
+        rec = struct.calcsize(rec_fmt)
+        s._send(struct.pack('<BLBB', s.CMD_CAPTURE, period, len(addrs), size) +
+                struct.pack('<%dL' % (len(addrs)), *addrs))
+        samples = []
+        nsamples = 0
+        data = bytearray()
+        pending = bytearray()
+        stopped = False
+        t = time.perf_counter()
+        while True:
+            if not stopped and (
+                    (count is not None and nsamples >= count) or
+                    (duration is not None and
+                     time.perf_counter() - t >= duration)):
+                # any byte stops it
+                s._send(b'\0')
+                stopped = True
+            d = s.dev.read(max(1, s.dev.in_waiting))
+            if stopped and not d:
+                # timed out waiting for the end of the capture
+                return None
+            pending += d
+            while len(pending) >= 2:
+                n = struct.unpack_from('<H', pending)[0]
+                if not n or len(pending) < 2 + n:
+                    break
+                data += pending[2:2 + n]
+                del pending[:2 + n]
+            if len(data) >= rec:
+                end = len(data) - len(data) % rec
+                new = list(struct.iter_unpack(rec_fmt, data[:end]))
+                del data[:end]
+                if count is not None:
+                    new = new[:count - nsamples]
+                nsamples += len(new)
+                if on_data is not None:
+                    on_data(new)
+                else:
+                    samples += new
+            if len(pending) >= 2 and not struct.unpack_from('<H', pending)[0]:
+                break
+        # the zero length chunk, counters and the ack
+        rest = pending[2:]
+        rest += s.dev.read(13 - len(rest))
+        if len(rest) < 13:
+            return None
+        res = dict(zip(('samples', 'dropped', 'late'),
+                       struct.unpack('<3L', rest[:12])))
+        ack = rest[12]
+        if ((ack & 0xf0) != (s.CMD_CAPTURE & 0xf0) or
+                (ack & 0xf) != s.STATUS_OK):
+            return None
+        return samples, res
+
+    def stats(s):
+        # counters kept by a STATS=1 server, see stats.h
+        s._send(struct.pack('<B', s.CMD_STATS))
+        d = s.dev.read(Stats.SIZE)
+        if len(d) < Stats.SIZE:
+            # a server without STATS=1 only sends its UNK_CMD ack, which
+            # the read above took before timing out
+            s.print('stats: short read %s' % (binascii.hexlify(d)))
+            return None
+        if not s._check_rv(s.CMD_STATS):
+            return None
+        return Stats(d)
+
+    def stats_reset(s):
+        s._send(struct.pack('<B', s.CMD_STATS_RESET))
+        return s._check_rv(s.CMD_STATS_RESET)
+
+    def call(s, addr, *args):
+        # Calls a thumb function on target with up to four u32 args, the
+        # server keeps running. Returns (r0, r1, cycles) or None.
+        assert len(args) <= 4
+        args += (0,) * (4 - len(args))
+        s._send(struct.pack('<BL4L', s.CMD_CALL, addr | 1, *args))
+        d = s.dev.read(12)
+        if not s._check_rv_slow(s.CMD_CALL):
+            return None
+        return struct.unpack('<3L', d)
+
+    def api(s):
+        # address of the server's struct sp_api_t, see module.h
+        if getattr(s, '_api', None) is None:
+            s._send(struct.pack('<B', s.CMD_API))
+            d = s.dev.read(4)
+            if not s._check_rv(s.CMD_API):
+                return None
+            s._api = struct.unpack('<L', d)[0]
+        return s._api
+
+    def load_module(s, image, base=None):
+        # image is a module built against module.h/module.ld (or its path).
+        # By default it goes into sram0 and has to fit there, an explicit
+        # base must keep it clear of the server.
+        if isinstance(image, str):
+            with open(image, 'rb') as f:
+                image = f.read()
+        m = Module(s, image, s.MODULE_BASE if base is None else base)
+        end = m.base + len(m.image)
+        if base is None and end > s.MODULE_BASE + s.MODULE_SIZE:
+            raise ValueError('module too big for sram0')
+        if m.base < s.SERVER_END and end > s.USB_CODE_ENTRY:
+            raise ValueError('module overlaps the server')
+        if not s.write_compressed(m.base, m.image) or not s.verify(
+                m.base, m.image):
+            return None
+        return m
+
     def jump(s, addr):
         addr |= 1
         d = struct.pack('<BL', s.CMD_EXEC, addr)
         s._send(d)
 
 
-def com_open(serial_path, debug):
+def com_open(serial_path, debug, uart=False, max_baud=None):
     try:
-        c = RomCom(serial_path, debug)
+        c = RomCom(serial_path, debug, uart, max_baud)
         if not c.try_ping():
             print('failed to ping, make sure rom is in serial programming mode')
             return None
@@ -178,24 +967,253 @@ def com_open(serial_path, debug):
         print('failed to open %s' % (serial_path))
         return None
 
+class PanelJob:
+    # one board of a panel, see program_panel()
+    def __init__(s, port):
+        s.port = port
+        s.ok = False
+        s.attempts = 0
+        s.nbytes = 0
+        s.time = 0
+
+
+def _panel_program(job, image, addr, opts, lz_cache, log):
+    t = time.perf_counter()
+    c = None
+    try:
+        c = RomCom(job.port, uart=opts['uart'], max_baud=opts['max_baud'])
+        c.lz_cache = lz_cache
+        if opts['exec_file']:
+            log(job, 'loading')
+            if opts['stage1']:
+                ok = c.try_ping() and c.exec_staged(opts['stage1'],
+                                                    opts['exec_file'])
+            else:
+                ok = c.try_ping() and c.exec_file(opts['exec_file'])
+            if not ok:
+                log(job, 'load failed')
+                return
+        c.reopen_dev()
+        last = [-1]
+
+        def progress(done, total):
+            pct = 100 * done // total
+            if pct // 25 != last[0]:
+                last[0] = pct // 25
+                log(job, '%3d%%' % (pct))
+
+        # the server stays up across retries, so only flashing is retried
+        while job.attempts <= opts['retries']:
+            job.attempts += 1
+            try:
+                if opts['full']:
+                    n = len(image) if c.flash_image(addr, image) else None
+                else:
+                    n = c.flash_delta(addr, image, progress=progress)
+                if n is not None:
+                    job.ok = True
+                    job.nbytes = n
+                    return
+            except (IOError, struct.error, serial.SerialException) as e:
+                log(job, 'error: %s' % (e))
+            if job.attempts <= opts['retries']:
+                log(job, 'retrying')
+                c.reopen_dev()
+    except (IOError, struct.error, serial.SerialException) as e:
+        log(job, 'error: %s' % (e))
+    finally:
+        job.time = time.perf_counter() - t
+        log(job, 'OK, %d bytes programmed' % (job.nbytes) if job.ok
+            else 'NG')
+        if c is not None:
+            c.dev.close()
+
+
+def program_panel(ports, image_path, addr=0, exec_file=None, full=False,
+                  retries=2, jobs=None, uart=False, max_baud=None,
+                  stage1=None):
+    # Flashes the same image into every board on ports concurrently, one
+    # thread per board (at most jobs at once). The image is mapped once and
+    # shared read-only, and so are its compressed blocks. Returns the list
+    # of PanelJob.
+    opts = {'exec_file': exec_file, 'full': full, 'retries': retries,
+            'uart': uart, 'max_baud': max_baud, 'stage1': stage1}
+    lock = threading.Lock()
+
+    def log(job, msg):
+        with lock:
+            print('%-16s %s' % (job.port, msg))
+            sys.stdout.flush()
+
+    results = [PanelJob(p) for p in ports]
+    with open(image_path, 'rb') as f:
+        mm = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+    try:
+        image = mm if not len(mm) & 1 else bytes(mm) + b'\xff'
+        lz_cache = LzCache()
+        t = time.perf_counter()
+        with concurrent.futures.ThreadPoolExecutor(
+                jobs or len(ports)) as pool:
+            futures = [pool.submit(_panel_program, job, image, addr, opts,
+                                   lz_cache, log) for job in results]
+        t = time.perf_counter() - t
+        # transfer errors end up in the jobs, anything else is raised here
+        for f in futures:
+            f.result()
+    finally:
+        mm.close()
+
+    print('%-16s %3s %8s %10s %8s' % ('port', '', 'attempts', 'bytes', 's'))
+    for job in results:
+        print('%-16s %3s %8d %10d %8.2f' % (job.port, 'OK' if job.ok else 'NG',
+                                             job.attempts, job.nbytes,
+                                             job.time))
+    nbytes = sum(job.nbytes for job in results)
+    print('%d/%d boards OK, %d bytes programmed in %.2fs (%.1f KiB/s)' %
+          (sum(job.ok for job in results), len(results), nbytes, t,
+           nbytes / t / 1024))
+    return results
+
+
+def parse_int(x):
+    return int(x, 0)
+
+
 if __name__ == '__main__':
     parser = argparse.ArgumentParser('Fujitsu Cortex-M3/M4 ROM comms')
     parser.add_argument('--port', default='COM4')
     parser.add_argument('--exec_file', default='./sram_code.bin')
     parser.add_argument('--skip_load', action='store_true')
+    parser.add_argument('--stage1', nargs='?', const='./stage1.bin',
+                        help='load exec_file through this first stage')
     parser.add_argument('--debug', action='store_true')
+    parser.add_argument('--uart', action='store_true',
+                        help='server built with UART=1, negotiate a rate')
+    parser.add_argument('--baud', type=parse_int,
+                        help='highest rate to try with --uart')
+    sub = parser.add_subparsers(dest='mode')
+    dump_parser = sub.add_parser('dump', help='dump target memory to a file')
+    dump_parser.add_argument('out')
+    dump_parser.add_argument('--region', choices=sorted(RomCom.REGIONS),
+                             default='flash')
+    dump_parser.add_argument('--addr', type=parse_int)
+    dump_parser.add_argument('--size', type=parse_int)
+    dump_parser.add_argument('--chunk', type=parse_int,
+                             help='read size, tuned on the first reads by default')
+    flash_parser = sub.add_parser('flash', help='program an image to flash')
+    flash_parser.add_argument('image')
+    flash_parser.add_argument('--addr', type=parse_int, default=0)
+    flash_parser.add_argument('--full', action='store_true',
+                              help='reprogram unchanged sectors too')
+    panel_parser = sub.add_parser(
+        'panel', help='flash an image into several boards at once')
+    panel_parser.add_argument('image')
+    panel_parser.add_argument('ports', nargs='+')
+    panel_parser.add_argument('--addr', type=parse_int, default=0)
+    panel_parser.add_argument('--full', action='store_true',
+                              help='reprogram unchanged sectors too')
+    panel_parser.add_argument('--retries', type=int, default=2)
+    panel_parser.add_argument('--jobs', type=int,
+                              help='boards programmed at once, default all')
+    call_parser = sub.add_parser('call', help='call a function on target')
+    call_parser.add_argument('addr', type=parse_int)
+    call_parser.add_argument('args', type=parse_int, nargs='*')
+    capture_parser = sub.add_parser(
+        'capture', help='sample addresses at a fixed rate on target')
+    capture_parser.add_argument('addrs', type=parse_int, nargs='+')
+    capture_parser.add_argument('--size', type=int, choices=(1, 2, 4),
+                                default=4)
+    capture_parser.add_argument('--rate', type=float, default=1000)
+    capture_parser.add_argument('--core_hz', type=float, required=True,
+                                help='core clock the server runs at, 80e6 '
+                                'with make CLOCK=1, else as the ROM left it')
+    capture_parser.add_argument('--count', type=int)
+    capture_parser.add_argument('--duration', type=float, default=1)
+    capture_parser.add_argument('--out', help='write samples as csv')
+    stats_parser = sub.add_parser('stats',
+                                  help='show counters of a STATS=1 server')
+    stats_parser.add_argument('--reset', action='store_true')
     args = parser.parse_args()
 
-    c = com_open(args.port, args.debug)
+    if args.mode == 'panel':
+        results = program_panel(
+            args.ports, args.image, args.addr,
+            None if args.skip_load else args.exec_file, args.full,
+            args.retries, args.jobs, args.uart, args.baud, args.stage1)
+        exit(0 if all(job.ok for job in results) else 1)
+
+    c = com_open(args.port, args.debug, args.uart, args.baud)
     if c is None:
         exit()
 
     if not args.skip_load:
-        rv = c.exec_file(args.exec_file)
+        if args.stage1:
+            rv = c.exec_staged(args.stage1, args.exec_file)
+        else:
+            rv = c.exec_file(args.exec_file)
         print('file exec %s' % ('OK' if rv else 'NG'))
 
     c.reopen_dev()
 
+    if args.mode == 'dump':
+        addr, size = RomCom.REGIONS[args.region]
+        if args.addr is not None:
+            addr = args.addr
+        if args.size is not None:
+            size = args.size
+        exit(0 if c.dump(addr, size, args.out, args.chunk) else 1)
+
+    if args.mode == 'flash':
+        with open(args.image, 'rb') as f:
+            image = f.read()
+        t = time.perf_counter()
+        if args.full:
+            n = len(image) if c.flash_image(args.addr, image) else None
+        else:
+            n = c.flash_delta(args.addr, image)
+        if n is None:
+            print('flash NG')
+            exit(1)
+        print('programmed %d of %d bytes (%d saved) in %.2fs' %
+              (n, len(image), len(image) - min(n, len(image)),
+               time.perf_counter() - t))
+        exit(0)
+
+    if args.mode == 'call':
+        rv = c.call(args.addr, *args.args)
+        if rv is None:
+            print('call NG')
+            exit(1)
+        print('r0 %08x r1 %08x, %d cycles' % rv)
+        exit(0)
+
+    if args.mode == 'capture':
+        t = time.perf_counter()
+        rv = c.capture(args.addrs, max(1, round(args.core_hz / args.rate)),
+                       args.size, args.count,
+                       None if args.count else args.duration)
+        if rv is None:
+            print('capture NG')
+            exit(1)
+        samples, res = rv
+        t = time.perf_counter() - t
+        if args.out:
+            with open(args.out, 'w') as f:
+                f.write(','.join('%08x' % (a) for a in args.addrs) + '\n')
+                for v in samples:
+                    f.write(','.join('%x' % (x) for x in v) + '\n')
+        print('%d samples in %.2fs, %d dropped, %d late' %
+              (len(samples), t, res['dropped'], res['late']))
+        exit(0)
+
+    if args.mode == 'stats':
+        st = c.stats()
+        if st is None:
+            print('no stats, server not built with STATS=1?')
+            exit(1)
+        print(st.render())
+        exit(0 if not args.reset or c.stats_reset() else 1)
+
     # do the reg pokes non-sp mode boot does...
     FM3_GPIO_BASE = 0x40033000
     GPIO_ADE = FM3_GPIO_BASE + 0x500
@@ -203,12 +1221,13 @@ if __name__ == '__main__':
     GPIO_PFR0 = FM3_GPIO_BASE + 0
     GPIO_PCR0 = FM3_GPIO_BASE + 0x100
     GPIO_PDIR0 = FM3_GPIO_BASE + 0x300
-    c.write32(GPIO_ADE, 0)
-    c.write32(GPIO_EPFR00, 0)
-    c.write32(GPIO_PFR0, 0)
-    c.write32(GPIO_PCR0, 0)
-    gpio_in_p00_p1f = c.read32(GPIO_PDIR0)
-    print('gpio_in_p00_p1f %08x' % (gpio_in_p00_p1f))
+    with c.batch() as b:
+        b.write32(GPIO_ADE, 0)
+        b.write32(GPIO_EPFR00, 0)
+        b.write32(GPIO_PFR0, 0)
+        b.write32(GPIO_PCR0, 0)
+        gpio_in_p00_p1f = b.read32(GPIO_PDIR0)
+    print('gpio_in_p00_p1f %08x' % (gpio_in_p00_p1f.value))
     # ugh...still 0x821f
 
     code.InteractiveConsole(locals=locals()).interact('Entering shell...')
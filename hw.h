@@ -0,0 +1,48 @@
+#pragma once
+
+/*
+ Accessors for registers whose accesses have side effects beyond a plain
+ load/store (fifos, the flash command interface, the CRC unit). The host
+ build (HOST_SIM, see sim/) routes them to simulated devices.
+*/
+
+#ifdef HOST_SIM
+u8 sim_rd8(vu8 *p);
+u16 sim_rd16(vu16 *p);
+u32 sim_rd32(vu32 *p);
+void sim_wr8(vu8 *p, u8 val);
+void sim_wr16(vu16 *p, u16 val);
+void sim_wr32(vu32 *p, u32 val);
+
+#define HW_RD8(p) sim_rd8(p)
+#define HW_RD16(p) sim_rd16(p)
+#define HW_RD32(p) sim_rd32(p)
+#define HW_WR8(p, val) sim_wr8(p, val)
+#define HW_WR16(p, val) sim_wr16(p, val)
+#define HW_WR32(p, val) sim_wr32(p, val)
+// lets the simulated devices make progress, called from the transport's
+// polling loop
+void sim_poll();
+#define HW_POLL() sim_poll()
+// blocks until the host or a paced packet is due
+void sim_wait();
+#define HW_WAIT() sim_wait()
+
+// sections only mean something in the target image
+#define SECTION(name)
+// host code has no thumb bit
+#define CODE_PTR(addr) ((void *)((addr) & ~1))
+#else
+#define HW_RD8(p) (*(p))
+#define HW_RD16(p) (*(p))
+#define HW_RD32(p) (*(p))
+#define HW_WR8(p, val) (*(p) = (val))
+#define HW_WR16(p, val) (*(p) = (val))
+#define HW_WR32(p, val) (*(p) = (val))
+#define HW_POLL()
+#define HW_WAIT() __asm__ volatile("wfe")
+
+#define SECTION(name) __attribute__((section(name)))
+// function pointer from an address as the host sends it
+#define CODE_PTR(addr) ((void *)((addr) | 1))
+#endif
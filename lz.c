@@ -0,0 +1,60 @@
+/*
+Bounds checked LZ4 block decoder
+*/
+
+#include "common.h"
+#include "lz.h"
+#include "mem.h"
+
+static int lz4_len(const u8 **src, const u8 *end, u32 *len) {
+  u32 b;
+  do {
+    if (*src >= end)
+      return -1;
+    b = *(*src)++;
+    *len += b;
+  } while (b == 255);
+  return 0;
+}
+
+int lz4_decode(u8 *dst, u32 dst_len, const u8 *src, u32 src_len) {
+  const u8 *s = src;
+  const u8 *s_end = src + src_len;
+  u8 *d = dst;
+  u8 *d_end = dst + dst_len;
+
+  while (s < s_end) {
+    u32 token = *s++;
+    u32 len = token >> 4;
+    u32 off;
+    const u8 *m;
+
+    if (len == 15 && lz4_len(&s, s_end, &len))
+      return -1;
+    if (len > (u32)(s_end - s) || len > (u32)(d_end - d))
+      return -1;
+    mem_copy(d, s, len);
+    d += len;
+    s += len;
+    // the last sequence is literals only
+    if (s == s_end)
+      break;
+
+    if (s_end - s < 2)
+      return -1;
+    off = s[0] | (s[1] << 8);
+    s += 2;
+    if (!off || off > (u32)(d - dst))
+      return -1;
+    len = token & 15;
+    if (len == 15 && lz4_len(&s, s_end, &len))
+      return -1;
+    len += 4;
+    if (len > (u32)(d_end - d))
+      return -1;
+    // may overlap, so byte by byte
+    for (m = d - off; len; len--)
+      *d++ = *m++;
+  }
+  return d - dst;
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+// LZ4 block format. Returns the decompressed size, or -1 if src is
+// malformed or would not fit into dst.
+int lz4_decode(u8 *dst, u32 dst_len, const u8 *src, u32 src_len);
@@ -0,0 +1,114 @@
+/*
+Word-at-a-time memory kernels (no libc here)
+*/
+
+#include "common.h"
+#include "mem.h"
+
+void mem_copy(void *dst, const void *src, u32 len) {
+  u8 *d = dst;
+  const u8 *s = src;
+
+  if (!(((u32)d ^ (u32)s) & 3)) {
+    while (((u32)d & 3) && len) {
+      *d++ = *s++;
+      len--;
+    }
+    for (; len >= 16; len -= 16, d += 16, s += 16) {
+      u32 a = ((const u32 *)s)[0];
+      u32 b = ((const u32 *)s)[1];
+      u32 c = ((const u32 *)s)[2];
+      u32 e = ((const u32 *)s)[3];
+      ((u32 *)d)[0] = a;
+      ((u32 *)d)[1] = b;
+      ((u32 *)d)[2] = c;
+      ((u32 *)d)[3] = e;
+    }
+    for (; len >= 4; len -= 4, d += 4, s += 4)
+      *(u32 *)d = *(const u32 *)s;
+  }
+  while (len--)
+    *d++ = *s++;
+}
+
+// The pattern is laid down once, then doubled with mem_copy() unless a
+// word holds a whole number of patterns
+void mem_fill(void *dst, const u8 *pat, u32 plen, u32 len) {
+  u8 *d = dst;
+  u32 i, done;
+
+  if (!plen || !len)
+    return;
+  if (!(4 % plen)) {
+    u32 w;
+    for (i = 0; ((u32)d & 3) && i < len; i++)
+      *d++ = pat[i % plen];
+    len -= i;
+    w = pat[i % plen] | (pat[(i + 1) % plen] << 8) |
+        (pat[(i + 2) % plen] << 16) | (pat[(i + 3) % plen] << 24);
+    for (; len >= 16; len -= 16, d += 16) {
+      ((u32 *)d)[0] = w;
+      ((u32 *)d)[1] = w;
+      ((u32 *)d)[2] = w;
+      ((u32 *)d)[3] = w;
+    }
+    for (; len >= 4; len -= 4, d += 4)
+      *(u32 *)d = w;
+    for (i = 0; i < len; i++)
+      d[i] = w >> (8 * i);
+    return;
+  }
+  done = plen < len ? plen : len;
+  for (i = 0; i < done; i++)
+    d[i] = pat[i];
+  while (done < len) {
+    u32 n = done < len - done ? done : len - done;
+    mem_copy(d + done, d, n);
+    done += n;
+  }
+}
+
+u32 mem_compare(const void *a, const void *b, u32 len) {
+  const u8 *p = a;
+  const u8 *q = b;
+  u32 pos = 0;
+
+  if (!(((u32)p ^ (u32)q) & 3)) {
+    while (((u32)(p + pos) & 3) && pos < len && p[pos] == q[pos])
+      pos++;
+    if (!((u32)(p + pos) & 3)) {
+      for (; len - pos >= 4; pos += 4) {
+        if (*(const u32 *)(p + pos) != *(const u32 *)(q + pos))
+          break;
+      }
+    }
+  }
+  while (pos < len && p[pos] == q[pos])
+    pos++;
+  return pos;
+}
+
+// Words without the first pattern byte are skipped whole (the zero byte
+// test can give false positives, never false negatives)
+u32 mem_find(const void *buf, u32 len, const u8 *pat, u32 plen) {
+  const u8 *p = buf;
+  u32 first = pat[0] * 0x01010101;
+  u32 pos, last;
+
+  if (!plen || plen > len)
+    return len;
+  last = len - plen;
+  for (pos = 0; pos <= last;) {
+    if (!((u32)(p + pos) & 3) && last - pos >= 3) {
+      u32 v = *(const u32 *)(p + pos) ^ first;
+      if (!((v - 0x01010101) & ~v & 0x80808080)) {
+        pos += 4;
+        continue;
+      }
+    }
+    if (p[pos] == pat[0] && mem_compare(p + pos, pat, plen) == plen)
+      return pos;
+    pos++;
+  }
+  return len;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+void mem_copy(void *dst, const void *src, u32 len);
+// dst gets pat (plen bytes) repeated over len bytes
+void mem_fill(void *dst, const u8 *pat, u32 plen, u32 len);
+// Offset of the first differing byte, len if there is none
+u32 mem_compare(const void *a, const void *b, u32 len);
+// Offset of the first occurrence of pat, len if there is none
+u32 mem_find(const void *buf, u32 len, const u8 *pat, u32 plen);
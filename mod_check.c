@@ -0,0 +1,46 @@
+/*
+Example module (make mod_check.bin): checks which don't need the data to
+go over the transport
+*/
+
+#include "common.h"
+#include "module.h"
+
+// Adler-32 as zlib.adler32() computes it
+static u64 adler32(const struct sp_api_t *api, u32 addr, u32 len, u32 c) {
+  const u8 *p = (const u8 *)addr;
+  u32 a = 1, b = 0;
+  while (len) {
+    // largest run before b could overflow
+    u32 n = len < 5552 ? len : 5552;
+    len -= n;
+    while (n--) {
+      a += *p++;
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+  return (b << 16) | a;
+}
+
+// Fills [addr, addr + len) with each pattern in turn and reads it back.
+// Returns the offset of the first bad byte (len if there was none) in r0,
+// the failing pattern in r1. The range is left holding the last pattern.
+static u64 ram_test(const struct sp_api_t *api, u32 addr, u32 len, u32 c) {
+  static const u32 patterns[] = {0x00000000, 0xffffffff, 0x55aa55aa,
+                                 0xaa55aa55, 0x01020408, 0x10204080};
+  u32 i, pos;
+  for (i = 0; i < ARRAY_SIZE(patterns); i++) {
+    const u8 *pat = (const u8 *)&patterns[i];
+    api->mem_fill((void *)addr, pat, sizeof(u32), len);
+    api->sp_poll();
+    for (pos = 0; pos < len; pos++) {
+      if (((const u8 *)addr)[pos] != pat[pos & 3])
+        return ((u64)patterns[i] << 32) | pos;
+    }
+  }
+  return len;
+}
+
+SP_MODULE(adler32, ram_test);
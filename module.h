@@ -0,0 +1,68 @@
+#pragma once
+
+/*
+ Loadable modules: position independent code the host loads into sram0
+ (RomCom.load_module()) and runs with CMD_CALL while the server keeps
+ going. Built with -fPIC against module.ld; the loader rebases the GOT,
+ so initialized data must not hold pointers. Every entry point gets the
+ server's sp_api as its first argument, then up to three from the host.
+*/
+
+// services of the resident server, only ever appended to
+struct sp_api_t {
+  u32 version;
+  u32 (*crc32)(const u8 *buf, u32 len);
+  void (*mem_copy)(void *dst, const void *src, u32 len);
+  void (*mem_fill)(void *dst, const u8 *pat, u32 plen, u32 len);
+  u32 (*mem_compare)(const void *a, const void *b, u32 len);
+  u32 (*mem_find)(const void *buf, u32 len, const u8 *pat, u32 plen);
+  void (*sp_poll)();
+};
+
+#define SP_API_VERSION 1
+
+typedef u64 (*sp_module_fn_t)(const struct sp_api_t *api, u32 a, u32 b,
+                              u32 c);
+
+// what the host learns about a module, at its start
+struct sp_module_t {
+  u32 magic;
+  u32 size; // up to the end of .bss
+  u32 got_start;
+  u32 got_end;
+  u32 nfuncs;
+  sp_module_fn_t funcs[]; // entry points, as offsets from the start
+};
+
+#define SP_MODULE_MAGIC 0x444f4d53 // "SMOD"
+
+// SP_MODULE(fn0, fn1, ...) declares the header, the entry points' indices
+// are what the host calls them by
+#ifndef HOST_SIM
+#define SP_MODULE(...)                                                         \
+  extern u8 __module_end[], __got_start[], __got_end[];                       \
+  __attribute__((section(".module"), used)) const struct sp_module_t           \
+      sp_module = {                                                            \
+          SP_MODULE_MAGIC,                                                     \
+          (u32)__module_end,                                                   \
+          (u32)__got_start,                                                    \
+          (u32)__got_end,                                                      \
+          sizeof((sp_module_fn_t[]){__VA_ARGS__}) / sizeof(sp_module_fn_t),    \
+          {__VA_ARGS__},                                                       \
+  }
+#else
+// Modules built for the sim (sim/mod_*.bin) have 64 bit pointers, which C
+// won't truncate to u32 in an initializer, so the assembler lays out the
+// header. The discarded array only keeps the entry points from going away.
+#define SP_MODULE_ASM(magic, ...)                                              \
+  __asm__(".section .module, \"a\"\n"                                          \
+          ".globl sp_module\n"                                                 \
+          "sp_module: .long " STR(magic) ", __module_end\n"                     \
+          ".long __got_start, __got_end, (2f - 1f) / 4\n"                      \
+          "1: .long " #__VA_ARGS__ "\n"                                        \
+          "2: .previous")
+#define SP_MODULE(...)                                                         \
+  SP_MODULE_ASM(SP_MODULE_MAGIC, __VA_ARGS__);                                 \
+  __attribute__((section(".discard"), used)) static const sp_module_fn_t      \
+      sp_module_keep[] = {__VA_ARGS__}
+#endif
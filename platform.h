@@ -1,7 +1,9 @@
 /******************************************************************************
  * Peripheral memory map
  ******************************************************************************/
+#ifndef FM3_FLASH_BASE /* relocated in the host build */
 #define FM3_FLASH_BASE        (0x00000000UL)                 /* Flash Base                             */
+#endif
 #define FM3_PERIPH_BASE       (0x40000000UL)                 /* Peripheral  Base                       */
 #define FM3_CM3_BASE          (0xE0100000UL)                 /* CM3 Private                            */
 
@@ -0,0 +1,275 @@
+#!/usr/bin/env python3
+# Throughput/latency benchmark for the transfer paths of the server.
+# By default the host build (sim/fm3_sim) is started and driven over its
+# pty; --port runs the same cases against an already loaded board.
+import argparse
+import os
+import signal
+import statistics
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+import zlib
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), '..'))
+from fujitsu_rom_com import RomCom, program_panel
+
+# sram0 is not used by the image, so it is free to scribble over
+SRAM_ADDR = 0x1fff8000
+SRAM_SIZE = 0x8000
+SIZES = (64, 1024, 4096, SRAM_SIZE)
+
+
+class Sim:
+    def __init__(s, path, args):
+        s.proc = subprocess.Popen([path] + args, stdout=subprocess.PIPE,
+                                  universal_newlines=True)
+        s.port = s._line('pty')[0]
+        s.flash_base = int(s._line('flash')[0], 16)
+        s.call_addr = int(s._line('call')[0], 16)
+
+    def _line(s, key):
+        while True:
+            l = s.proc.stdout.readline()
+            if not l:
+                raise IOError('sim exited')
+            w = l.split()
+            if w and w[0] == key:
+                return w[1:]
+
+    def stats(s):
+        s.proc.send_signal(signal.SIGUSR1)
+        return {k: int(v) for k, v in
+                (kv.split('=') for kv in s._line('stats'))}
+
+    def close(s):
+        s.proc.kill()
+        s.proc.wait()
+
+
+class Bench:
+    COUNTERS = ('rx_pkts', 'tx_pkts', 'fifo_rd', 'fifo_wr', 'polls')
+
+    def __init__(s, com, sim, iters):
+        s.com = com
+        s.sim = sim
+        s.iters = iters
+        s.failed = False
+        cols = ('case', 'bytes', 'ms', 'KiB/s')
+        if sim:
+            cols += s.COUNTERS
+        print(('%-24s %8s %9s %9s' + ' %9s' * (len(cols) - 4)) % cols)
+
+    def run(s, name, nbytes, fn):
+        before = s.sim.stats() if s.sim else None
+        times = []
+        for i in range(s.iters):
+            t = time.perf_counter()
+            ok = fn()
+            times.append(time.perf_counter() - t)
+            if ok is False:
+                s.failed = True
+                name += ' FAILED'
+                break
+        after = s.sim.stats() if s.sim else None
+        t = statistics.median(times)
+        rate = '%9.1f' % (nbytes / t / 1024) if nbytes else '%9s' % '-'
+        line = '%-24s %8d %9.3f %s' % (name, nbytes, t * 1000, rate)
+        if before:
+            n = len(times)
+            line += ''.join(' %9d' % ((after[k] - before[k]) // n)
+                            for k in s.COUNTERS)
+        print(line)
+        sys.stdout.flush()
+
+
+def run_cases(b, c, flash_base, flash_size, call_addr=None, module=None):
+    data = os.urandom(SRAM_SIZE)
+    # roughly what firmware images look like: some code, lots of padding
+    image = os.urandom(flash_size // 4) + b'\xff' * (flash_size * 3 // 4)
+
+    b.run('ping', 0, c.ping)
+    # a failed read comes back short, so the read cases compare with this
+    if not c.write(SRAM_ADDR, data):
+        b.failed = True
+        print('failed to write test data')
+        return
+    word = struct.unpack_from('<L', data)[0]
+    b.run('read32', 4, lambda: c.read32(SRAM_ADDR) == word)
+    b.run('write32', 4, lambda: c.write32(SRAM_ADDR, 0x12345678))
+
+    def batch():
+        with c.batch() as bt:
+            for i in range(32):
+                bt.write32(SRAM_ADDR + i * 4, i)
+                bt.read32(SRAM_ADDR + i * 4)
+    b.run('batch 64 ops', 64 * 4, batch)
+
+    # the batch left its words at the start
+    c.write(SRAM_ADDR, data[:32 * 4])
+    for n in SIZES:
+        b.run('read', n, lambda: c.read(SRAM_ADDR, n) == data[:n])
+        b.run('read crc', n,
+              lambda: c.read(SRAM_ADDR, n, crc=True) == data[:n])
+    for n in SIZES:
+        b.run('write', n, lambda: c.write(SRAM_ADDR, data[:n]))
+        b.run('write crc', n, lambda: c.write(SRAM_ADDR, data[:n], crc=True))
+
+    b.run('read pipelined', SRAM_SIZE,
+          lambda: c.read_pipelined(SRAM_ADDR, SRAM_SIZE) == data)
+    b.run('write pipelined', SRAM_SIZE,
+          lambda: c.write_pipelined(SRAM_ADDR, data))
+    b.run('write stream', SRAM_SIZE, lambda: c.write_stream(SRAM_ADDR, data))
+    b.run('write compressed rand', SRAM_SIZE,
+          lambda: c.write_compressed(SRAM_ADDR, data))
+    b.run('write compressed zero', SRAM_SIZE,
+          lambda: c.write_compressed(SRAM_ADDR, bytes(SRAM_SIZE)))
+    b.run('crc', SRAM_SIZE, lambda: c.crc(SRAM_ADDR, SRAM_SIZE) is not None)
+
+    half = SRAM_SIZE // 2
+    b.run('mem fill', SRAM_SIZE,
+          lambda: c.mem_fill(SRAM_ADDR, SRAM_SIZE, b'abc') and
+          c.read(SRAM_ADDR + 1, 5) == b'bcabc')
+    b.run('mem copy', half,
+          lambda: c.write(SRAM_ADDR, data[:half]) and
+          c.mem_copy(SRAM_ADDR + half, SRAM_ADDR, half) and
+          c.verify(SRAM_ADDR + half, data[:half]))
+    b.run('mem compare', half,
+          lambda: c.write8(SRAM_ADDR + half + 1000, data[1000] ^ 1) and
+          c.mem_compare(SRAM_ADDR, SRAM_ADDR + half, half) == 1000)
+    needle = b'\x5a\xa5needle'
+
+    def find():
+        if not (c.mem_fill(SRAM_ADDR, SRAM_SIZE, b'\x5a') and
+                c.write(SRAM_ADDR + 3, needle) and
+                c.write(SRAM_ADDR + SRAM_SIZE - len(needle), needle)):
+            return False
+        return c.mem_find(SRAM_ADDR, SRAM_SIZE, needle) == [
+            SRAM_ADDR + 3, SRAM_ADDR + SRAM_SIZE - len(needle)]
+    b.run('mem find', SRAM_SIZE, find)
+    def capture():
+        # 10k samples of two words at 100kHz (80MHz core), a slow link
+        # drops some on the way
+        if not c.write(SRAM_ADDR, data[:8]):
+            return False
+        rv = c.capture((SRAM_ADDR, SRAM_ADDR + 4), 800, count=10000)
+        if rv is None:
+            return False
+        samples, res = rv
+        return (len(samples) == 10000 and
+                set(samples) == {struct.unpack('<2L', data[:8])})
+    b.run('capture 100kHz', 10000 * 8, capture)
+    if call_addr is not None:
+        crc = zlib.crc32(data[:4096])
+        b.run('call', 4096,
+              lambda: c.write(SRAM_ADDR, data[:4096]) and
+              c.call(call_addr, SRAM_ADDR, 4096)[0] == crc)
+    if module is not None:
+        # mod_check.bin built for the sim, loaded at the start of sram0
+        buf = SRAM_ADDR + SRAM_SIZE // 2
+
+        def module_call():
+            m = c.load_module(module)
+            if m is None or not c.write(buf, data[:4096]):
+                return False
+            adler = m.call(0, buf, 4096)
+            ram_test = m.call(1, buf, 4096)
+            return (adler is not None and ram_test is not None and
+                    adler[0] == zlib.adler32(data[:4096]) and
+                    ram_test[0] == 4096)
+        b.run('module call', 4096, module_call)
+
+    b.run('flash erase', flash_size, lambda: c.flash_erase(flash_base, 0))
+    b.run('flash program', flash_size,
+          lambda: c.flash_erase(flash_base, 0) and
+          c.flash_program(flash_base, image))
+    b.run('flash image', flash_size,
+          lambda: c.flash_image(flash_base, image, compress=False))
+    b.run('flash image compressed', flash_size,
+          lambda: c.flash_image(flash_base, image))
+    b.run('flash delta unchanged', flash_size,
+          lambda: c.flash_delta(flash_base, image) == 0)
+
+    # a rebuild touching one small sector, flipped back and forth
+    images = [image, bytearray(image)]
+    images[1][0x2100] ^= 0xff
+
+    def delta_one():
+        images.reverse()
+        return c.flash_delta(flash_base, bytes(images[0])) == 0x2000
+    b.run('flash delta 1 sector', flash_size, delta_one)
+    b.run('flash dump', flash_size,
+          lambda: c.read_pipelined(flash_base, flash_size) == images[0])
+
+
+def run_panel(args, n):
+    # program_panel() against n sims: a first pass writing the image, a
+    # second one finding nothing to do
+    sims = []
+    try:
+        for i in range(n):
+            sims.append(Sim(args.sim, ['-p', str(args.pace), '-w',
+                                       str(args.prog), '-e', str(args.erase)]))
+        image = os.urandom(RomCom.FLASH_SIZE // 4)
+        with tempfile.NamedTemporaryFile(suffix='.bin') as f:
+            f.write(image)
+            f.flush()
+            ok = True
+            for i in range(2):
+                results = program_panel([sim.port for sim in sims], f.name,
+                                        sims[0].flash_base, uart=args.uart)
+                ok &= all(job.ok for job in results)
+                ok &= all(job.nbytes == (len(image) if i == 0 else 0)
+                          for job in results)
+        return ok
+    finally:
+        for sim in sims:
+            sim.close()
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser('server transfer benchmark')
+    parser.add_argument('--sim', default=os.path.join(
+        os.path.dirname(__file__), 'fm3_sim'))
+    parser.add_argument('--port', help='use a loaded board instead')
+    parser.add_argument('--iters', type=int, default=5)
+    parser.add_argument('--uart', action='store_true',
+                        help='server built with UART=1')
+    parser.add_argument('--pace', type=int, default=0,
+                        help='sim: minimum usec between usb packets')
+    parser.add_argument('--prog', type=int, default=0,
+                        help='sim: usec per flash halfword program')
+    parser.add_argument('--erase', type=int, default=0,
+                        help='sim: msec per flash sector erase')
+    parser.add_argument('--panel', type=int, default=0,
+                        help='program this many sims at once instead')
+    args = parser.parse_args()
+
+    if args.panel:
+        exit(0 if run_panel(args, args.panel) else 1)
+
+    sim = None
+    if args.port:
+        port, flash_base = args.port, 0
+    else:
+        sim = Sim(args.sim, ['-p', str(args.pace), '-w', str(args.prog),
+                             '-e', str(args.erase)])
+        port, flash_base = sim.port, sim.flash_base
+
+    try:
+        c = RomCom(port, uart=args.uart)
+        c.reopen_dev()
+        if not c.try_ping():
+            print('failed to ping %s' % (port))
+            exit(1)
+        b = Bench(c, sim, args.iters)
+        run_cases(b, c, flash_base, RomCom.FLASH_SIZE,
+                  sim.call_addr if sim else None,
+                  os.path.join(os.path.dirname(args.sim), 'mod_check.bin')
+                  if sim else None)
+    finally:
+        if sim:
+            sim.close()
+    exit(1 if b.failed else 0)
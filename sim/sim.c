@@ -0,0 +1,773 @@
+/*
+Host build of the server for benchmarking without a board.
+
+The server code is compiled as is (with HOST_SIM) and talks to the host
+over a pty. Target memory is mapped at the target addresses, registers are
+plain memory except for the ones accessed through hw.h, which are routed
+to the device models here: usb endpoints 1/2 or with UART=1 the MFS uart
+(fifo <-> pty), the flash command interface, the CRC unit, the DMAC, the
+DWT cycle counter and the clock status. The models are advanced from the
+transport's polling loop, so everything runs on one thread.
+
+Counters are printed on SIGUSR1, see sim/bench.py.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <termios.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "crc.h"
+#include "flash.h"
+#include "hw.h"
+#include "platform.h"
+
+#define SRAM_BASE 0x1ff80000UL
+#define SRAM_SIZE 0x102000UL // sram0, sram1 and the rom mirror
+#define PERIPH_SIZE 0x70000UL
+
+#define USB_PKT_MAX 64
+#define USB_EPXC(i) (FM3_USB0_BASE + 0x28 + 4 * ((i)-1))
+#define EPXC_DIR (1 << 12)
+#define EPXC_EPEN (1 << 15)
+#define USB_EPXS(i) (FM3_USB0_BASE + 0x4C + 4 * ((i)-1))
+#define USB_EPXDT(i) (FM3_USB0_BASE + 0x64 + 4 * ((i)-1))
+#define EPXS_SIZE_MASK 0x1ff
+#define EPXS_DRQ 0x400
+
+#define FLASH_IF_FSTR (FM3_FLASH_IF_BASE + 0x08)
+#define CRC_CRCCR (FM3_CRC_BASE + 0x00)
+#define CRC_CRCINIT (FM3_CRC_BASE + 0x04)
+#define CRC_CRCIN (FM3_CRC_BASE + 0x08)
+#define CRC_CRCR (FM3_CRC_BASE + 0x0C)
+#define DMAC_CH(ch) (FM3_DMAC_BASE + 0x10 + 0x10 * (ch))
+#define DMAC_NUM_CHANNELS 8
+#define CRG_SCM_CTL (FM3_CRG_BASE + 0x00)
+#define CRG_SCM_STR (FM3_CRG_BASE + 0x04)
+// the core's debug registers (stats.c), only the cycle counter does
+// anything
+#define SCS_BASE 0xE0000000UL
+#define SCS_SIZE 0x10000UL
+#define DWT_CYCCNT 0xE0001004UL
+// clock the cycle counter pretends to run at
+#define SIM_CORE_MHZ 80
+
+// status reads a flash operation stays busy for, at the least
+#define FLASH_BUSY_READS 4
+
+static struct {
+  u64 rx_pkts, rx_bytes;
+  u64 tx_pkts, tx_bytes;
+  u64 fifo_rd, fifo_wr;
+  u64 polls;
+  u64 flash_prog, flash_erase, flash_busy_reads;
+  u64 crc_bytes;
+  u64 dma_xfers, dma_units, dma_errors;
+  u64 overruns;
+  u64 waits;
+} stats;
+
+static struct {
+  u32 pace_us;       // minimum time between usb packets
+  u32 prog_us;       // flash program time per halfword
+  u32 erase_ms;      // flash sector erase time
+  u32 dma_fail;      // every nth dma transfer fails, 0 for none
+  u32 overrun;       // uart: every nth received byte is lost to an overrun
+} opts;
+
+static int pty_fd;
+static volatile sig_atomic_t stats_requested;
+
+static u64 now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static vu16 *reg16(u32 addr) { return (vu16 *)(uintptr_t)addr; }
+static vu32 *reg32(u32 addr) { return (vu32 *)(uintptr_t)addr; }
+
+/*
+ usb: endpoint 1 receives, endpoint 2 sends. DRQ set means the endpoint
+ belongs to the server (packet available / fifo writable).
+*/
+
+static struct {
+  u8 buf[USB_PKT_MAX];
+  u32 len, pos;
+  u64 next_ns;
+} rx;
+
+static struct {
+  u8 buf[USB_PKT_MAX * 2];
+  u32 len;
+  u64 next_ns;
+  int alive_seen;
+} tx;
+
+// the state the ROM leaves after enumerating
+static void usb_init() {
+  *reg16(USB_EPXC(1)) = EPXC_EPEN | USB_PKT_MAX;
+  *reg16(USB_EPXC(2)) = EPXC_EPEN | EPXC_DIR | USB_PKT_MAX;
+  // bulk in, fifo starts out empty
+  *reg16(USB_EPXS(2)) = EPXS_DRQ;
+}
+
+// pushes whatever the server sent out to the pty
+static void tx_flush(u64 now) {
+  u32 off = 0;
+
+  if (!tx.len)
+    return;
+  // first thing the server sends is the alive byte meant for the rom
+  // loader, nobody is listening for it here
+  if (!tx.alive_seen) {
+    tx.alive_seen = 1;
+    off = 1;
+  }
+  while (off < tx.len) {
+    ssize_t rv = write(pty_fd, tx.buf + off, tx.len - off);
+    if (rv < 0 && errno != EAGAIN && errno != EINTR)
+      break;
+    if (rv > 0)
+      off += rv;
+  }
+  stats.tx_pkts++;
+  stats.tx_bytes += tx.len;
+  tx.len = 0;
+  tx.next_ns = now + opts.pace_us * 1000ull;
+}
+
+#ifndef SP_UART
+static void usb_rx(u64 now) {
+  vu16 *epxs = reg16(USB_EPXS(1));
+  ssize_t len;
+
+  if ((*epxs & EPXS_DRQ) || now < rx.next_ns)
+    return;
+  len = read(pty_fd, rx.buf, sizeof(rx.buf));
+  if (len <= 0)
+    return;
+  rx.len = len;
+  rx.pos = 0;
+  rx.next_ns = now + opts.pace_us * 1000ull;
+  stats.rx_pkts++;
+  stats.rx_bytes += len;
+  *epxs = (*epxs & ~EPXS_SIZE_MASK) | len | EPXS_DRQ;
+}
+
+static void usb_tx(u64 now) {
+  vu16 *epxs = reg16(USB_EPXS(2));
+
+  if ((*epxs & EPXS_DRQ) || now < tx.next_ns)
+    return;
+  tx_flush(now);
+  *epxs |= EPXS_DRQ;
+}
+#endif
+
+static int usb_fifo_rd(u32 addr, u32 width, u32 *val) {
+  u32 i;
+  if (addr != USB_EPXDT(1))
+    return 0;
+  stats.fifo_rd++;
+  *val = 0;
+  for (i = 0; i < width && rx.pos < rx.len; i++)
+    *val |= rx.buf[rx.pos++] << (8 * i);
+  return 1;
+}
+
+static int usb_fifo_wr(u32 addr, u32 width, u32 val) {
+  u32 i;
+  if (addr != USB_EPXDT(2))
+    return 0;
+  stats.fifo_wr++;
+  for (i = 0; i < width && tx.len < sizeof(tx.buf); i++)
+    tx.buf[tx.len++] = val >> (8 * i);
+  return 1;
+}
+
+#ifdef SP_UART
+/*
+ uart: the MFS channel of UART_CH instead of usb. The pty is read a
+ fifo's worth at a time, sent bytes go out on the next poll. Baud rates
+ and line errors aren't modelled.
+*/
+
+#ifndef UART_CH
+#define UART_CH 0
+#endif
+#define UART_BASE (FM3_MFS0_UART_BASE + 0x100 * UART_CH)
+#define UART_SSR (UART_BASE + 0x05)
+#define UART_DR (UART_BASE + 0x08)
+#define UART_BGR (UART_BASE + 0x0C)
+#define UART_FBYTE1 (UART_BASE + 0x18)
+#define UART_FBYTE2 (UART_BASE + 0x19)
+#define UART_FIFO_LEN 16
+#define SSR_TBI (1 << 0)
+#define SSR_TDRE (1 << 1)
+#define SSR_RDRF (1 << 2)
+#define SSR_ORE (1 << 3)
+#define SSR_REC (1 << 7)
+// what the ROM leaves for 9600 baud off a 40MHz bus
+#define UART_ROM_BGR 4166
+
+// overruns injected with -O
+static struct {
+  u8 carry[UART_FIFO_LEN]; // came in behind the lost byte
+  u32 carry_len;
+  u32 nth;
+  int ore;
+} uart_ovr;
+
+static void uart_rx(u64 now) {
+  ssize_t len, i;
+
+  // after an overrun nothing comes in until the server clears it
+  if (rx.pos < rx.len || uart_ovr.ore || now < rx.next_ns)
+    return;
+  if (uart_ovr.carry_len) {
+    len = uart_ovr.carry_len;
+    memcpy(rx.buf, uart_ovr.carry, len);
+    uart_ovr.carry_len = 0;
+  } else {
+    len = read(pty_fd, rx.buf, UART_FIFO_LEN);
+    if (len <= 0)
+      return;
+  }
+  for (i = 0; opts.overrun && i < len; i++) {
+    if (++uart_ovr.nth < opts.overrun)
+      continue;
+    // byte i is lost, the bytes before it are still received
+    uart_ovr.nth = 0;
+    uart_ovr.ore = 1;
+    uart_ovr.carry_len = len - i - 1;
+    memcpy(uart_ovr.carry, rx.buf + i + 1, uart_ovr.carry_len);
+    len = i;
+    stats.overruns++;
+    break;
+  }
+  rx.len = len;
+  rx.pos = 0;
+  rx.next_ns = now + opts.pace_us * 1000ull;
+  stats.rx_pkts++;
+  stats.rx_bytes += len;
+}
+
+static void uart_tx(u64 now) {
+  if (now >= tx.next_ns)
+    tx_flush(now);
+}
+
+static int uart_rd(u32 addr, u32 *val) {
+  switch (addr) {
+  case UART_SSR:
+    *val = (tx.len ? 0 : SSR_TBI | SSR_TDRE) |
+           (rx.pos < rx.len ? SSR_RDRF : 0) | (uart_ovr.ore ? SSR_ORE : 0);
+    return 1;
+  case UART_DR:
+    stats.fifo_rd++;
+    *val = rx.pos < rx.len ? rx.buf[rx.pos++] : 0;
+    return 1;
+  case UART_FBYTE1:
+    *val = tx.len;
+    return 1;
+  case UART_FBYTE2:
+    *val = rx.len - rx.pos;
+    return 1;
+  }
+  return 0;
+}
+
+static int uart_wr(u32 addr, u32 val) {
+  switch (addr) {
+  case UART_DR:
+    stats.fifo_wr++;
+    if (tx.len < sizeof(tx.buf))
+      tx.buf[tx.len++] = val;
+    return 1;
+  case UART_SSR:
+    if (val & SSR_REC)
+      uart_ovr.ore = 0;
+    return 1;
+  case UART_FBYTE1:
+  case UART_FBYTE2:
+    return 1;
+  }
+  return 0;
+}
+#endif
+
+/*
+ flash: the command sequences from flash.c, completion is signalled by
+ DQ6 toggling on reads while busy.
+*/
+
+static const u32 sim_flash_sectors[] = {
+    0x00000, 0x02000, 0x04000, 0x06000, 0x08000, 0x20000, FLASH_SIZE,
+};
+
+enum {
+  FL_IDLE,
+  FL_UNLOCK1,
+  FL_UNLOCK2,
+  FL_PROGRAM,
+  FL_ERASE,
+  FL_ERASE_UNLOCK1,
+  FL_ERASE_UNLOCK2,
+};
+
+static struct {
+  int state;
+  u32 busy_reads;
+  u64 busy_until;
+  u16 toggle;
+} fl;
+
+static u8 *flash_mem(u32 off) { return (u8 *)(uintptr_t)(FM3_FLASH_BASE + off); }
+
+static void flash_busy(u64 ns) {
+  fl.busy_reads = FLASH_BUSY_READS;
+  fl.busy_until = now_ns() + ns;
+}
+
+static void flash_erase_range(u32 beg, u32 end) {
+  memset(flash_mem(beg), 0xff, end - beg);
+  stats.flash_erase++;
+  flash_busy(opts.erase_ms * 1000000ull);
+}
+
+static void flash_write(u32 off, u16 val) {
+  int i;
+
+  switch (fl.state) {
+  case FL_IDLE:
+  case FL_ERASE:
+    if (off == 0x1550 && val == 0xAA) {
+      fl.state = fl.state == FL_ERASE ? FL_ERASE_UNLOCK1 : FL_UNLOCK1;
+      return;
+    }
+    break;
+  case FL_UNLOCK1:
+  case FL_ERASE_UNLOCK1:
+    if (off == 0x0AA8 && val == 0x55) {
+      fl.state++;
+      return;
+    }
+    break;
+  case FL_UNLOCK2:
+    if (off == 0x1550 && val == 0xA0) {
+      fl.state = FL_PROGRAM;
+      return;
+    }
+    if (off == 0x1550 && val == 0x80) {
+      fl.state = FL_ERASE;
+      return;
+    }
+    break;
+  case FL_PROGRAM:
+    // can only clear bits
+    *(u16 *)flash_mem(off & ~1) &= val;
+    stats.flash_prog++;
+    flash_busy(opts.prog_us * 1000ull);
+    fl.state = FL_IDLE;
+    return;
+  case FL_ERASE_UNLOCK2:
+    fl.state = FL_IDLE;
+    if (off == 0x1550 && val == 0x10) {
+      for (i = 0; i < (int)ARRAY_SIZE(sim_flash_sectors) - 1; i++)
+        flash_erase_range(sim_flash_sectors[i], sim_flash_sectors[i + 1]);
+      return;
+    }
+    if (val == 0x30) {
+      for (i = 0; i < (int)ARRAY_SIZE(sim_flash_sectors) - 1; i++) {
+        if (off >= sim_flash_sectors[i] && off < sim_flash_sectors[i + 1])
+          flash_erase_range(sim_flash_sectors[i], sim_flash_sectors[i + 1]);
+      }
+      return;
+    }
+    break;
+  }
+  // reset or garbage
+  fl.state = FL_IDLE;
+}
+
+static u16 flash_read(u32 off) {
+  if (fl.busy_reads || now_ns() < fl.busy_until) {
+    if (fl.busy_reads)
+      fl.busy_reads--;
+    stats.flash_busy_reads++;
+    fl.toggle ^= 1 << 6;
+    return fl.toggle;
+  }
+  return *(u16 *)flash_mem(off & ~1);
+}
+
+static int in_flash(u32 addr) { return addr - FM3_FLASH_BASE < FLASH_SIZE; }
+
+/*
+ crc: zlib CRC-32, the only configuration crc.c uses
+*/
+
+static u32 crc_table[256];
+static u32 crc_state;
+
+static void crc_init_table() {
+  u32 i, j, c;
+  for (i = 0; i < 256; i++) {
+    for (c = i, j = 0; j < 8; j++)
+      c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+    crc_table[i] = c;
+  }
+}
+
+static void crc_feed(u32 val, u32 width) {
+  u32 i;
+  for (i = 0; i < width; i++, val >>= 8)
+    crc_state = crc_table[(crc_state ^ val) & 0xff] ^ (crc_state >> 8);
+  stats.crc_bytes += width;
+}
+
+/*
+ cycle counter: follows the host clock, writes set its current value
+*/
+
+static u32 cyccnt_base;
+
+static u32 cyccnt_now() { return now_ns() * SIM_CORE_MHZ / 1000; }
+
+static int scs_rd(u32 addr, u32 *val) {
+  if (addr - SCS_BASE >= SCS_SIZE)
+    return 0;
+  *val = addr == DWT_CYCCNT ? cyccnt_now() - cyccnt_base : 0;
+  return 1;
+}
+
+static int scs_wr(u32 addr, u32 val) {
+  if (addr - SCS_BASE >= SCS_SIZE)
+    return 0;
+  if (addr == DWT_CYCCNT)
+    cyccnt_base = cyccnt_now() - val;
+  return 1;
+}
+
+/*
+ generic accessors. hw.h routes side effecting register accesses here,
+ anything not modelled is plain memory.
+*/
+
+static u32 sim_rd(u32 addr, u32 width) {
+  u32 val;
+  if (usb_fifo_rd(addr, width, &val) || scs_rd(addr, &val))
+    return val;
+#ifdef SP_UART
+  if (uart_rd(addr, &val))
+    return val;
+#endif
+  if (in_flash(addr) && width == 2)
+    return flash_read(addr - FM3_FLASH_BASE);
+  if (addr == CRC_CRCR)
+    return ~crc_state;
+  // oscillators and the PLL are stable right away, SCM_STR just mirrors
+  // what SCM_CTL asks for
+  if (addr == CRG_SCM_STR)
+    return *(vu8 *)(uintptr_t)CRG_SCM_CTL;
+  switch (width) {
+  case 1:
+    return *(vu8 *)(uintptr_t)addr;
+  case 2:
+    return *(vu16 *)(uintptr_t)addr;
+  default:
+    return *(vu32 *)(uintptr_t)addr;
+  }
+}
+
+static void sim_wr(u32 addr, u32 width, u32 val) {
+  if (usb_fifo_wr(addr, width, val) || scs_wr(addr, val))
+    return;
+#ifdef SP_UART
+  if (uart_wr(addr, val))
+    return;
+#endif
+  if (in_flash(addr) && width == 2) {
+    flash_write(addr - FM3_FLASH_BASE, val);
+    return;
+  }
+  if (addr == CRC_CRCCR) {
+    if (val & 1)
+      crc_state = *reg32(CRC_CRCINIT);
+    return;
+  }
+  if (addr - CRC_CRCIN < 4) {
+    crc_feed(val, width);
+    return;
+  }
+  switch (width) {
+  case 1:
+    *(vu8 *)(uintptr_t)addr = val;
+    break;
+  case 2:
+    *(vu16 *)(uintptr_t)addr = val;
+    break;
+  default:
+    *(vu32 *)(uintptr_t)addr = val;
+    break;
+  }
+}
+
+u8 sim_rd8(vu8 *p) { return sim_rd((uintptr_t)p, 1); }
+u16 sim_rd16(vu16 *p) { return sim_rd((uintptr_t)p, 2); }
+u32 sim_rd32(vu32 *p) { return sim_rd((uintptr_t)p, 4); }
+void sim_wr8(vu8 *p, u8 val) { sim_wr((uintptr_t)p, 1, val); }
+void sim_wr16(vu16 *p, u16 val) { sim_wr((uintptr_t)p, 2, val); }
+void sim_wr32(vu32 *p, u32 val) { sim_wr((uintptr_t)p, 4, val); }
+
+/*
+ dmac: block transfers started by dma.c complete on the next poll
+*/
+
+#define DMACA_EB (1u << 31)
+#define DMACB_SS_DONE (5 << 16)
+// any other stop status is an error to dma.c
+#define DMACB_SS_ERROR (1 << 16)
+
+static void dma_step() {
+  static u32 nth;
+  int ch;
+  for (ch = 0; ch < DMAC_NUM_CHANNELS; ch++) {
+    vu32 *regs = reg32(DMAC_CH(ch));
+    u32 a = regs[0], b = regs[1];
+    u32 src = regs[2], dst = regs[3];
+    u32 width = 1 << ((b >> 26) & 3);
+    u32 count, i;
+
+    if (!(a & DMACA_EB))
+      continue;
+    count = (a & 0xffff) + 1;
+    if (opts.dma_fail && ++nth == opts.dma_fail) {
+      // fails before moving anything
+      nth = 0;
+      stats.dma_errors++;
+      regs[1] = b | DMACB_SS_ERROR;
+      regs[0] = a & ~DMACA_EB;
+      continue;
+    }
+    for (i = 0; i < count; i++) {
+      sim_wr(dst, width, sim_rd(src, width));
+      if (!(b & (1 << 25)))
+        src += width;
+      if (!(b & (1 << 24)))
+        dst += width;
+    }
+    stats.dma_xfers++;
+    stats.dma_units += count;
+    regs[1] = b | DMACB_SS_DONE;
+    regs[0] = a & ~DMACA_EB;
+  }
+}
+
+static void print_stats() {
+  printf("stats rx_pkts=%llu rx_bytes=%llu tx_pkts=%llu tx_bytes=%llu "
+         "fifo_rd=%llu fifo_wr=%llu polls=%llu flash_prog=%llu "
+         "flash_erase=%llu flash_busy_reads=%llu crc_bytes=%llu "
+         "dma_xfers=%llu dma_units=%llu dma_errors=%llu overruns=%llu "
+         "waits=%llu\n",
+         (unsigned long long)stats.rx_pkts, (unsigned long long)stats.rx_bytes,
+         (unsigned long long)stats.tx_pkts, (unsigned long long)stats.tx_bytes,
+         (unsigned long long)stats.fifo_rd, (unsigned long long)stats.fifo_wr,
+         (unsigned long long)stats.polls,
+         (unsigned long long)stats.flash_prog,
+         (unsigned long long)stats.flash_erase,
+         (unsigned long long)stats.flash_busy_reads,
+         (unsigned long long)stats.crc_bytes,
+         (unsigned long long)stats.dma_xfers,
+         (unsigned long long)stats.dma_units,
+         (unsigned long long)stats.dma_errors,
+         (unsigned long long)stats.overruns,
+         (unsigned long long)stats.waits);
+  fflush(stdout);
+}
+
+// polls without any device activity before the sim starts sleeping
+#define IDLE_POLLS 64
+
+void sim_poll() {
+  static u64 last_activity;
+  static u32 idle_polls;
+  u64 now = now_ns();
+  u64 activity;
+
+  stats.polls++;
+  if (stats_requested) {
+    stats_requested = 0;
+    print_stats();
+  }
+  dma_step();
+#ifdef SP_UART
+  uart_tx(now);
+  uart_rx(now);
+#else
+  usb_tx(now);
+  usb_rx(now);
+#endif
+
+  // once the server is only spinning on an empty endpoint, wait for the
+  // host instead of burning the cpu
+  activity = stats.rx_pkts + stats.fifo_rd + stats.fifo_wr +
+             stats.flash_busy_reads + stats.crc_bytes + stats.dma_xfers;
+  if (activity != last_activity || now < rx.next_ns || now < tx.next_ns) {
+    last_activity = activity;
+    idle_polls = 0;
+  } else if (++idle_polls >= IDLE_POLLS) {
+    struct pollfd pfd = {.fd = pty_fd, .events = POLLIN};
+    poll(&pfd, 1, 10);
+  }
+}
+
+// the server's WFE: sleeps until the host sends something or a paced
+// packet is due, at most 10ms so stats requests still get through
+void sim_wait() {
+  struct pollfd pfd = {.fd = pty_fd, .events = POLLIN};
+  u64 now = now_ns();
+  u64 due = now + 10000000ull;
+  struct timespec ts;
+
+  stats.waits++;
+  // sent data goes out once its pacing slot is reached
+  if (tx.len && tx.next_ns < due)
+    due = tx.next_ns;
+  // data waiting in the pty only matters once the next packet may go in
+  if (now < rx.next_ns) {
+    pfd.events = 0;
+    if (rx.next_ns < due)
+      due = rx.next_ns;
+  }
+  if (due > now) {
+    ts.tv_sec = (due - now) / 1000000000ull;
+    ts.tv_nsec = (due - now) % 1000000000ull;
+    ppoll(&pfd, 1, &ts, NULL);
+  }
+  sim_poll();
+}
+
+static void on_sigusr1(int sig) {
+  (void)sig;
+  stats_requested = 1;
+}
+
+static void map_fixed(u32 addr, u32 size, int prot, int fill) {
+  void *p = mmap((void *)(uintptr_t)addr, size, prot,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+  if (p != (void *)(uintptr_t)addr) {
+    fprintf(stderr, "failed to map %08x\n", addr);
+    exit(1);
+  }
+  memset(p, fill, size);
+}
+
+static int open_pty() {
+  struct termios t;
+  int fd = posix_openpt(O_RDWR | O_NOCTTY);
+  int slave;
+
+  if (fd < 0 || grantpt(fd) || unlockpt(fd))
+    return -1;
+  // keep a slave fd open so the master doesn't see hangups while the
+  // client reopens the port
+  slave = open(ptsname(fd), O_RDWR | O_NOCTTY);
+  if (slave < 0 || tcgetattr(slave, &t))
+    return -1;
+  cfmakeraw(&t);
+  tcsetattr(slave, TCSANOW, &t);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [-p pace_us] [-w prog_us] [-e erase_ms] [-D n] [-O n]\n"
+          "  -p  minimum time between usb packets\n"
+          "  -w  flash program time per halfword\n"
+          "  -e  flash sector erase time\n"
+          "  -D  fail every nth dma transfer\n"
+          "  -O  UART=1: lose every nth received byte to an overrun\n",
+          name);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  static u8 serv_stack[1 << 20] __attribute__((aligned(16)));
+  static ucontext_t serv_ctx;
+  extern void sram_entry();
+  int opt;
+
+  while ((opt = getopt(argc, argv, "p:w:e:D:O:")) != -1) {
+    switch (opt) {
+    case 'p':
+      opts.pace_us = strtoul(optarg, NULL, 0);
+      break;
+    case 'w':
+      opts.prog_us = strtoul(optarg, NULL, 0);
+      break;
+    case 'e':
+      opts.erase_ms = strtoul(optarg, NULL, 0);
+      break;
+    case 'D':
+      opts.dma_fail = strtoul(optarg, NULL, 0);
+      break;
+    case 'O':
+      opts.overrun = strtoul(optarg, NULL, 0);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  map_fixed(FM3_FLASH_BASE, FLASH_SIZE, PROT_READ | PROT_WRITE, 0xff);
+  // modules built for the sim (sim/mod_*.bin) run from sram
+  map_fixed(SRAM_BASE, SRAM_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, 0);
+  map_fixed(FM3_PERIPH_BASE, PERIPH_SIZE, PROT_READ | PROT_WRITE, 0);
+  *reg32(FLASH_IF_FSTR) = 1;
+  // the ROM runs from the main oscillator in usb mode
+  *(vu8 *)(uintptr_t)CRG_SCM_CTL = 0x22;
+  crc_init_table();
+  usb_init();
+#ifdef SP_UART
+  *reg16(UART_BGR) = UART_ROM_BGR;
+#endif
+
+  pty_fd = open_pty();
+  if (pty_fd < 0) {
+    perror("pty");
+    return 1;
+  }
+  signal(SIGUSR1, on_sigusr1);
+  // sim_wait() sleeps for packet pacing, which the default 50us of
+  // timer slack would stretch
+  prctl(PR_SET_TIMERSLACK, 1);
+  // crc32() doubles as something to CMD_CALL
+  printf("pty %s\nflash %08lx\ncall %08lx\n", ptsname(pty_fd),
+         FM3_FLASH_BASE, (unsigned long)(uintptr_t)crc32);
+  fflush(stdout);
+
+  // the server truncates pointers to u32, so it runs on a stack which
+  // (like everything else it touches) lives below 4GiB
+  getcontext(&serv_ctx);
+  serv_ctx.uc_stack.ss_sp = serv_stack;
+  serv_ctx.uc_stack.ss_size = sizeof(serv_stack);
+  serv_ctx.uc_link = NULL;
+  makecontext(&serv_ctx, sram_entry, 0);
+  setcontext(&serv_ctx);
+  return 1;
+}
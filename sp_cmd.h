@@ -0,0 +1,54 @@
+#pragma once
+
+// Commands and structures shared by the server (sp_serv.c) and the
+// first stage loader (stage1.c)
+
+#define CMD_PING 0x18
+#define CMD_TAG 0x19
+#define CMD_SET_BAUD 0x1a
+#define CMD_READ 0x20
+#define CMD_READV 0x21
+#define CMD_WRITEV 0x22
+#define CMD_EXEC 0x23
+#define CMD_WRITE_STREAM 0x24
+#define CMD_WRITE_COMPRESSED 0x25
+#define CMD_CALL 0x26
+#define CMD_API 0x27
+#define CMD_WRITE 0x00
+#define CMD_FLASH_ERASE 0x30
+#define CMD_FLASH_PROGRAM 0x31
+#define CMD_FLASH_HASH 0x32
+#define CMD_CRC 0x40
+#define CMD_BATCH 0x50
+#define CMD_STATS 0x60
+#define CMD_STATS_RESET 0x61
+#define CMD_MEM_FILL 0x70
+#define CMD_MEM_COPY 0x71
+#define CMD_MEM_COMPARE 0x72
+#define CMD_MEM_FIND 0x73
+#define CMD_CAPTURE 0x80
+
+// sent once the image is up, in place of the ack of the ROM's finalize
+#define SP_ALIVE 0xA1
+
+#define STATUS_OK 1
+#define STATUS_NG 2
+#define STATUS_UNK_CMD 4
+
+// largest block CMD_WRITE_STREAM/CMD_WRITE_COMPRESSED work with
+#define STREAM_BLOCK 1024
+
+struct stream_args_t {
+  u32 addr;
+  u32 len;
+} __attribute__((packed));
+
+// Compressed data comes as a sequence of blocks, each decompressing to at
+// most STREAM_BLOCK bytes:
+//  comp_len == 0: raw_len bytes are skipped (e.g. already erased flash)
+//  comp_len == raw_len: stored as is
+//  otherwise: LZ4 block
+struct lz_block_t {
+  u16 raw_len;
+  u16 comp_len;
+} __attribute__((packed));
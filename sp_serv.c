@@ -1,45 +1,56 @@
 #include "common.h"
+#include "cm3.h"
+#include "crc.h"
+#include "flash.h"
+#include "hw.h"
+#include "lz.h"
+#include "mem.h"
+#include "module.h"
+#include "platform.h"
+#include "sp_cmd.h"
 #include "sp_xfer.h"
-
-#define SP_READ(x)                                                             \
-  do {                                                                         \
-    sp_read((void *)&(x), sizeof(x));                                          \
-  } while (0)
-
-#define SP_WRITE(x)                                                            \
-  do {                                                                         \
-    sp_write((void *)&(x), sizeof(x));                                         \
-  } while (0)
-
-#define CMD_PING 0x18
-#define CMD_READ 0x20
-#define CMD_READV 0x21
-#define CMD_WRITEV 0x22
-#define CMD_EXEC 0x23
-#define CMD_WRITE 0x00
-
-#define STATUS_OK 1
-#define STATUS_NG 2
-#define STATUS_UNK_CMD 4
+#include "stats.h"
 
 // in order to keep python side simple...annoyingly
 // have to keep using Fujitsu's struct
 struct rw_args_t {
-  u8 *addr;
-  u16 unused;
+  u32 addr;
+  u16 flags; // unused by ROM
   u16 len;
 } __attribute__((packed));
 
+// CRC-32 of the data follows it (after the data, before the checksum)
+#define RW_FLAG_CRC 1
+
+// A command may be prefixed with CMD_TAG and a tag byte, which is then
+// echoed after every ack of that command. Lets the host keep several
+// commands in flight and match up the completions.
+static struct {
+  u8 tag;
+  u8 tagged;
+} cur_cmd;
+
 static void send_ack(u8 cmd, u8 status) {
-  u8 ack = (cmd & 0xf0) | status;
-  SP_WRITE(ack);
+  u8 ack[2];
+  if (sp_failed() && status == STATUS_OK)
+    status = STATUS_NG;
+  ack[0] = (cmd & 0xf0) | status;
+  ack[1] = cur_cmd.tag;
+  sp_write(ack, cur_cmd.tagged ? sizeof(ack) : 1);
 }
 
+// bytes checksummed between transport polls by a CMD_READ with a CRC
+#define RW_CRC_CHUNK 256
+
 static void do_rw(u8 cmd) {
   struct rw_args_t args;
+  u8 *addr;
   u8 checksum;
+  u8 status = STATUS_OK;
+  u32 crc;
   SP_READ(args);
-  args.addr = (u8 *)__builtin_bswap32((u32)args.addr);
+  addr = (u8 *)__builtin_bswap32(args.addr);
+  args.flags = __builtin_bswap16(args.flags);
   args.len = __builtin_bswap16(args.len);
 
   // note: not fully compatible with Fujitsu sram code,
@@ -47,18 +58,42 @@ static void do_rw(u8 cmd) {
   switch (cmd) {
   case CMD_READ:
     SP_READ(checksum);
-    sp_write(args.addr, args.len);
+    if (args.flags & RW_FLAG_CRC) {
+      // checksum in pieces between polls, while the data is going out
+      u32 pos = 0, n;
+      sp_write_start(addr, args.len);
+      crc32_start();
+      while (!sp_write_done()) {
+        if (pos == args.len) {
+          sp_wait();
+          continue;
+        }
+        n = args.len - pos < RW_CRC_CHUNK ? args.len - pos : RW_CRC_CHUNK;
+        crc32_update(addr + pos, n);
+        pos += n;
+      }
+      crc32_update(addr + pos, args.len - pos);
+      crc = crc32_result();
+      SP_WRITE(crc);
+    } else {
+      sp_write(addr, args.len);
+    }
     break;
   case CMD_WRITE:
-    sp_read(args.addr, args.len);
+    sp_read(addr, args.len);
+    if (args.flags & RW_FLAG_CRC) {
+      SP_READ(crc);
+      if (crc != crc32(addr, args.len))
+        status = STATUS_NG;
+    }
     SP_READ(checksum);
     break;
   }
-  send_ack(cmd, STATUS_OK);
+  send_ack(cmd, status);
 }
 
 struct rw_v_args_t {
-  void *addr;
+  u32 addr;
   u8 size;
 } __attribute__((packed));
 
@@ -105,21 +140,615 @@ static void do_rw_v(u8 cmd) {
   send_ack(cmd, STATUS_OK);
 }
 
+#define STREAM_NBUF 2
+
+static u8 stream_bufs[STREAM_NBUF][STREAM_BLOCK] __attribute__((aligned(4)));
+
+#define STREAM_ACK_BLOCKS 1
+#define STREAM_FLASH_ONLY 2
+
+static int in_flash(u32 addr) { return addr - FM3_FLASH_BASE < FLASH_SIZE; }
+
+// Anything landing in the flash region gets programmed
+static int commit(u32 addr, const u8 *buf, u32 len, int flags) {
+  if (in_flash(addr) || (flags & STREAM_FLASH_ONLY))
+    return flash_program(addr, buf, len);
+  mem_copy((void *)addr, buf, len);
+  return 0;
+}
+
+// Receives len bytes through the staging buffers and commits them to addr.
+// The next block fills in the background (progressed by sp_poll() inside
+// the commit) while the current one is committed. With STREAM_ACK_BLOCKS,
+// every block is acked as soon as it is queued so the host can keep
+// streaming.
+static u8 stream_write(u8 cmd, u32 addr, u32 len, int flags) {
+  u8 status = STATUS_OK;
+  u32 cur = 0;
+
+  if (len)
+    sp_read_start(stream_bufs[cur], len > STREAM_BLOCK ? STREAM_BLOCK : len);
+  while (len) {
+    u8 *buf = stream_bufs[cur];
+    u16 num = len > STREAM_BLOCK ? STREAM_BLOCK : len;
+    while (!sp_read_done())
+      sp_wait();
+    len -= num;
+    if (flags & STREAM_ACK_BLOCKS)
+      send_ack(cmd, STATUS_OK);
+    cur = (cur + 1) % STREAM_NBUF;
+    if (len)
+      sp_read_start(stream_bufs[cur], len > STREAM_BLOCK ? STREAM_BLOCK : len);
+    // always consume the whole payload to stay in sync with the host
+    if (status == STATUS_OK && commit(addr, buf, num, flags))
+      status = STATUS_NG;
+    addr += num;
+  }
+  return status;
+}
+
+static void do_stream(u8 cmd) {
+  struct stream_args_t args;
+  u8 status = STATUS_OK;
+  SP_READ(args);
+  switch (cmd) {
+  case CMD_FLASH_ERASE:
+    if (flash_erase(args.addr, args.len))
+      status = STATUS_NG;
+    break;
+  case CMD_FLASH_PROGRAM:
+    status = stream_write(cmd, args.addr, args.len, STREAM_FLASH_ONLY);
+    break;
+  case CMD_WRITE_STREAM:
+    status = stream_write(cmd, args.addr, args.len, STREAM_ACK_BLOCKS);
+    break;
+  }
+  send_ack(cmd, status);
+}
+
+// Takes len bytes from the host and drops them
+static void skip_input(u32 len) {
+  while (len) {
+    u16 num = len > STREAM_BLOCK ? STREAM_BLOCK : len;
+    sp_read(stream_bufs[1], num);
+    len -= num;
+  }
+}
+
+// Every block the host declared is taken, even after a bad one, so the
+// ack comes where the host expects it. Nothing is written after an error.
+static void do_write_compressed(u8 cmd) {
+  struct stream_args_t args;
+  struct lz_block_t blk;
+  u8 status = STATUS_OK;
+  u8 *raw = stream_bufs[0];
+  u8 *comp = stream_bufs[1];
+  SP_READ(args);
+
+  while (args.len) {
+    SP_READ(blk);
+    // checked before any of the block is read
+    if (!blk.raw_len || blk.raw_len > args.len ||
+        blk.raw_len > STREAM_BLOCK || blk.comp_len > STREAM_BLOCK)
+      status = STATUS_NG;
+    if (status != STATUS_OK) {
+      skip_input(blk.comp_len);
+      // without a length there is no telling where the data ends
+      if (!blk.raw_len)
+        break;
+      args.len -= blk.raw_len < args.len ? blk.raw_len : args.len;
+      continue;
+    }
+    if (blk.comp_len) {
+      sp_read(comp, blk.comp_len);
+      if (blk.comp_len == blk.raw_len)
+        mem_copy(raw, comp, blk.raw_len);
+      else if (lz4_decode(raw, blk.raw_len, comp, blk.comp_len) !=
+               blk.raw_len)
+        status = STATUS_NG;
+      if (status == STATUS_OK && commit(args.addr, raw, blk.raw_len, 0))
+        status = STATUS_NG;
+    }
+    args.addr += blk.raw_len;
+    args.len -= blk.raw_len;
+  }
+  send_ack(cmd, status);
+}
+
+struct crc_args_t {
+  u32 addr;
+  u32 len;
+} __attribute__((packed));
+
+static void do_crc(u8 cmd) {
+  struct crc_args_t args;
+  u32 crc;
+  SP_READ(args);
+  crc = crc32((u8 *)args.addr, args.len);
+  SP_WRITE(crc);
+  send_ack(cmd, STATUS_OK);
+}
+
+struct flash_hash_t {
+  u32 addr;
+  u32 len;
+  u32 crc;
+} __attribute__((packed));
+
+// CRC-32 of every sector overlapping [addr, addr + len), clipped to the
+// range, so the host can tell which sectors an image would change. A count
+// goes first, then the hashes as they are computed.
+static void do_flash_hash(u8 cmd) {
+  struct stream_args_t args;
+  struct flash_hash_t hash;
+  u32 beg, end, pos;
+  u8 count = 0;
+  u8 status = STATUS_OK;
+  SP_READ(args);
+
+  if (!args.len || args.addr - FM3_FLASH_BASE >= FLASH_SIZE ||
+      args.len > FLASH_SIZE - (args.addr - FM3_FLASH_BASE))
+    status = STATUS_NG;
+  for (pos = args.addr; status == STATUS_OK && pos < args.addr + args.len;
+       pos = end) {
+    flash_sector(pos, &beg, &end);
+    count++;
+  }
+  SP_WRITE(count);
+  for (pos = args.addr; count--; pos = end) {
+    flash_sector(pos, &beg, &end);
+    if (end > args.addr + args.len)
+      end = args.addr + args.len;
+    hash.addr = pos;
+    hash.len = end - pos;
+    hash.crc = crc32((u8 *)pos, hash.len);
+    SP_WRITE(hash);
+  }
+  send_ack(cmd, status);
+}
+
+#define BATCH_READ 0
+#define BATCH_WRITE 1
+#define BATCH_RMW 2  // *addr = (*addr & ~mask) | (val & mask)
+#define BATCH_POLL 3 // until (*addr & mask) == val, or timeout iterations
+
+struct batch_op_t {
+  u8 op;
+  u8 size;
+  u32 addr;
+} __attribute__((packed));
+
+// u32 operands following each op
+static u32 batch_nargs(u8 op) {
+  switch (op) {
+  case BATCH_READ:
+    return 0;
+  case BATCH_WRITE:
+    return 1;
+  case BATCH_RMW:
+    return 2;
+  default:
+    return 3;
+  }
+}
+
+static int batch_size_ok(u8 size) {
+  return size == sizeof(u8) || size == sizeof(u16) || size == sizeof(u32);
+}
+
+static u32 batch_load(u32 addr, u8 size) {
+  switch (size) {
+  case sizeof(u8):
+    return *(vu8 *)addr;
+  case sizeof(u16):
+    return *(vu16 *)addr;
+  default:
+    return *(vu32 *)addr;
+  }
+}
+
+static void batch_store(u32 addr, u8 size, u32 val) {
+  switch (size) {
+  case sizeof(u8):
+    *(vu8 *)addr = val;
+    break;
+  case sizeof(u16):
+    *(vu16 *)addr = val;
+    break;
+  default:
+    *(vu32 *)addr = val;
+    break;
+  }
+}
+
+// results held back before going out, the last slot leaves room for done
+#define BATCH_RESULTS_MAX (sizeof(stream_bufs) / sizeof(u32) - 1)
+
+// Runs a list of register accesses in one round trip. Every BATCH_READ
+// yields a u32 result, followed by the number of ops which completed.
+// After a failing op the rest is still consumed, reads then yield 0.
+// Results are collected and sent together with done.
+static void do_batch(u8 cmd) {
+  u32 *results = (u32 *)stream_bufs;
+  u32 nresults = 0;
+  u16 count;
+  u16 done = 0;
+  u8 status = STATUS_OK;
+  SP_READ(count);
+
+  while (count--) {
+    struct batch_op_t op;
+    u32 args[3] = {0};
+    u32 val = 0;
+    SP_READ(op);
+    sp_read((u8 *)args, batch_nargs(op.op) * sizeof(u32));
+
+    if (status == STATUS_OK && (op.op > BATCH_POLL || !batch_size_ok(op.size)))
+      status = STATUS_NG;
+    if (status == STATUS_OK) {
+      switch (op.op) {
+      case BATCH_READ:
+        val = batch_load(op.addr, op.size);
+        break;
+      case BATCH_WRITE:
+        batch_store(op.addr, op.size, args[0]);
+        break;
+      case BATCH_RMW:
+        val = batch_load(op.addr, op.size);
+        batch_store(op.addr, op.size, (val & ~args[0]) | (args[1] & args[0]));
+        break;
+      case BATCH_POLL:
+        while ((batch_load(op.addr, op.size) & args[0]) != args[1]) {
+          if (!args[2]--) {
+            status = STATUS_NG;
+            break;
+          }
+        }
+        break;
+      }
+      if (status == STATUS_OK)
+        done++;
+    }
+    if (op.op == BATCH_READ) {
+      if (status != STATUS_OK)
+        val = 0;
+      if (nresults == BATCH_RESULTS_MAX) {
+        sp_write((u8 *)results, nresults * sizeof(u32));
+        nresults = 0;
+      }
+      results[nresults++] = val;
+    }
+  }
+  *(u16 *)&results[nresults] = done;
+  sp_write((u8 *)results, nresults * sizeof(u32) + sizeof(done));
+  send_ack(cmd, status);
+}
+
+struct mem_fill_args_t {
+  u32 addr;
+  u32 len;
+  u16 plen;
+} __attribute__((packed));
+
+// Whether [addr, addr + len) overlaps the running server
+static int hits_server(u32 addr, u32 len) {
+#ifdef HOST_SIM
+  // the sim runs the server from host memory
+  return 0;
+#else
+  extern u32 __image_start[], __bss_end[];
+  u32 start = (u32)__image_start, end = (u32)__bss_end;
+  return len && addr < end && (addr >= start || start - addr < len);
+#endif
+}
+
+// Pattern (plen bytes) follows the args. Only RAM can be filled.
+static void do_mem_fill(u8 cmd) {
+  struct mem_fill_args_t args;
+  u8 *pat = stream_bufs[1];
+  u8 status = STATUS_OK;
+  SP_READ(args);
+  if (!args.plen || args.plen > STREAM_BLOCK) {
+    send_ack(cmd, STATUS_NG);
+    return;
+  }
+  // the pattern is still taken, the host sends it regardless
+  sp_read(pat, args.plen);
+  if (in_flash(args.addr) || hits_server(args.addr, args.len))
+    status = STATUS_NG;
+  else
+    mem_fill((void *)args.addr, pat, args.plen, args.len);
+  send_ack(cmd, status);
+}
+
+struct mem_copy_args_t {
+  u32 dst;
+  u32 src;
+  u32 len;
+} __attribute__((packed));
+
+// A flash destination gets programmed (it has to be erased), and can't be
+// copied to from flash. Overlapping regions only work for dst < src.
+static void do_mem_copy(u8 cmd) {
+  struct mem_copy_args_t args;
+  u8 status = STATUS_OK;
+  SP_READ(args);
+  if ((in_flash(args.dst) && in_flash(args.src)) ||
+      (args.dst > args.src && args.dst - args.src < args.len) ||
+      hits_server(args.dst, args.len))
+    status = STATUS_NG;
+  else if (commit(args.dst, (u8 *)args.src, args.len, 0))
+    status = STATUS_NG;
+  send_ack(cmd, status);
+}
+
+// Replies with the offset of the first differing byte, len if none
+static void do_mem_compare(u8 cmd) {
+  struct mem_copy_args_t args;
+  u32 pos;
+  SP_READ(args);
+  pos = mem_compare((u8 *)args.dst, (u8 *)args.src, args.len);
+  SP_WRITE(pos);
+  send_ack(cmd, STATUS_OK);
+}
+
+struct mem_find_args_t {
+  u32 addr;
+  u32 len;
+  u16 max;
+  u16 plen;
+} __attribute__((packed));
+
+#define MEM_FIND_MAX (STREAM_BLOCK / sizeof(u32))
+
+// Replies with the number of matches found (stopping at max), then their
+// offsets from addr. Matches may overlap.
+static void do_mem_find(u8 cmd) {
+  struct mem_find_args_t args;
+  u32 *found = (u32 *)stream_bufs[0];
+  u8 *pat = stream_bufs[1];
+  u32 pos = 0;
+  u16 count = 0;
+  SP_READ(args);
+  if (!args.plen || args.plen > STREAM_BLOCK || args.max > MEM_FIND_MAX) {
+    send_ack(cmd, STATUS_NG);
+    return;
+  }
+  sp_read(pat, args.plen);
+  while (count < args.max && pos < args.len) {
+    pos += mem_find((u8 *)args.addr + pos, args.len - pos, pat, args.plen);
+    if (pos >= args.len)
+      break;
+    found[count++] = pos++;
+  }
+  SP_WRITE(count);
+  sp_write((u8 *)found, count * sizeof(u32));
+  send_ack(cmd, STATUS_OK);
+}
+
+#define CAPTURE_MAX_ADDRS 16
+// the ring starts past room for one chunk length, see capture_send()
+#define CAPTURE_RING_LEN (STREAM_NBUF * STREAM_BLOCK - sizeof(u16))
+// largest chunk sent in one go, so the host sees data at low rates too
+#define CAPTURE_CHUNK 512
+
+struct capture_args_t {
+  u32 period; // in core cycles
+  u8 naddr;
+  u8 size;
+} __attribute__((packed));
+
+// sent after the last chunk
+struct capture_result_t {
+  u32 samples;
+  u32 dropped; // the ring was full
+  u32 late;    // periods which passed without a sample
+} __attribute__((packed));
+
+static struct {
+  u8 *ring;
+  u32 rptr;
+  u32 wptr;
+  u32 sending; // bytes at rptr being sent
+} cap;
+
+static u32 capture_used() {
+  return (cap.wptr + CAPTURE_RING_LEN - cap.rptr) % CAPTURE_RING_LEN;
+}
+
+// the two bytes in front of rptr stay free for the next chunk's length
+static u32 capture_room() {
+  return CAPTURE_RING_LEN - 1 - sizeof(u16) - capture_used();
+}
+
+// Sends what the ring holds as chunks of a u16 length and the data. The
+// length goes into the two bytes in front of the chunk (already sent, or
+// in front of the ring), so each chunk is a single write.
+static void capture_send() {
+  u8 *chunk;
+  u32 n;
+  if (cap.sending) {
+    if (!sp_write_done())
+      return;
+    cap.rptr = (cap.rptr + cap.sending) % CAPTURE_RING_LEN;
+    cap.sending = 0;
+  }
+  n = capture_used();
+  if (!n)
+    return;
+  if (n > CAPTURE_RING_LEN - cap.rptr)
+    n = CAPTURE_RING_LEN - cap.rptr;
+  if (n > CAPTURE_CHUNK)
+    n = CAPTURE_CHUNK;
+  cap.sending = n;
+  chunk = cap.ring + cap.rptr - sizeof(u16);
+  chunk[0] = n;
+  chunk[1] = n >> 8;
+  sp_write_start(chunk, sizeof(u16) + n);
+}
+
+// Samples every address every period cycles (timed by DWT.CYCCNT) into a
+// ring which drains to the host while sampling goes on, until the host
+// sends a byte. A zero length chunk, the counters and the ack follow.
+static void do_capture(u8 cmd) {
+  struct capture_args_t args;
+  // a zero length ends the chunks
+  struct {
+    u16 end;
+    struct capture_result_t res;
+  } __attribute__((packed)) fin = {0};
+  u32 addrs[CAPTURE_MAX_ADDRS];
+  u32 rec, next, i, j;
+  u8 status = STATUS_OK;
+  u8 stop;
+  SP_READ(args);
+  if (!args.naddr || args.naddr > CAPTURE_MAX_ADDRS || !args.period ||
+      !batch_size_ok(args.size)) {
+    // still waits for the stop, the host can't tell it apart from data
+    status = STATUS_NG;
+  }
+  // takes all the addresses announced, only the first ones are kept
+  for (i = 0; i < args.naddr; i += j) {
+    j = args.naddr - i;
+    if (j > CAPTURE_MAX_ADDRS)
+      j = CAPTURE_MAX_ADDRS;
+    sp_read((u8 *)addrs, j * sizeof(u32));
+  }
+  if (status != STATUS_OK)
+    args.naddr = 0;
+  rec = args.naddr * args.size;
+
+  cap.ring = stream_bufs[0] + sizeof(u16);
+  cap.rptr = cap.wptr = cap.sending = 0;
+  sp_read_start(&stop, sizeof(stop));
+  cm3_cycles_enable();
+  next = HW_RD32(&dwt->CYCCNT) + args.period;
+  while (!sp_read_done()) {
+    u32 late = HW_RD32(&dwt->CYCCNT) - next;
+    if (status == STATUS_OK && (s32)late >= 0) {
+      if (capture_room() < rec) {
+        fin.res.dropped++;
+      } else {
+        for (i = 0; i < args.naddr; i++) {
+          u32 val = batch_load(addrs[i], args.size);
+          for (j = 0; j < args.size; j++) {
+            cap.ring[cap.wptr] = val >> (8 * j);
+            cap.wptr = (cap.wptr + 1) % CAPTURE_RING_LEN;
+          }
+        }
+        fin.res.samples++;
+      }
+      // fell behind: skip the periods which were missed
+      late /= args.period;
+      fin.res.late += late;
+      next += (late + 1) * args.period;
+    }
+    capture_send();
+  }
+  while (cap.sending || capture_used())
+    capture_send();
+  SP_WRITE(fin);
+  send_ack(cmd, status);
+}
+
+#ifdef SP_STATS
+static void do_stats(u8 cmd) {
+  // snapshot, sending it moves the counters
+  _Static_assert(sizeof(sp_stats) <= STREAM_BLOCK, "stats don't fit");
+  mem_copy(stream_bufs[0], &sp_stats, sizeof(sp_stats));
+  sp_write(stream_bufs[0], sizeof(sp_stats));
+  send_ack(cmd, STATUS_OK);
+}
+#endif
+
+#ifdef SP_UART
+// Acked at the current rate, the new one applies from the next command on.
+// If the host can't follow it sends a break, see sp_uart.c.
+static void do_set_baud(u8 cmd) {
+  u32 baud;
+  SP_READ(baud);
+  if (!sp_baud_ok(baud)) {
+    send_ack(cmd, STATUS_NG);
+    return;
+  }
+  send_ack(cmd, STATUS_OK);
+  sp_set_baud(baud);
+}
+#endif
+
+struct call_args_t {
+  u32 addr;
+  u32 args[4];
+} __attribute__((packed));
+
+struct call_result_t {
+  u32 r0;
+  u32 r1;
+  u32 cycles;
+} __attribute__((packed));
+
+typedef u64 (*call_fn_t)(u32, u32, u32, u32);
+
+// Calls addr and replies with r0/r1 and the cycles the
+// call took. The transport isn't serviced meanwhile unless the callee
+// does it.
+static void do_call(u8 cmd) {
+  struct call_args_t args;
+  struct call_result_t res;
+  u32 start;
+  u64 rv;
+  SP_READ(args);
+  cm3_cycles_enable();
+  start = HW_RD32(&dwt->CYCCNT);
+  rv = ((call_fn_t)CODE_PTR(args.addr))(args.args[0], args.args[1],
+                                        args.args[2], args.args[3]);
+  res.cycles = HW_RD32(&dwt->CYCCNT) - start;
+  res.r0 = rv;
+  res.r1 = rv >> 32;
+  SP_WRITE(res);
+  send_ack(cmd, STATUS_OK);
+}
+
+static const struct sp_api_t sp_api = {
+    SP_API_VERSION, crc32,    mem_copy, mem_fill,
+    mem_compare,    mem_find, sp_poll,
+};
+
+// where modules find the server's services
+static void do_api(u8 cmd) {
+  u32 addr = (u32)&sp_api;
+  SP_WRITE(addr);
+  send_ack(cmd, STATUS_OK);
+}
+
 static void do_exec() {
-  void *addr;
+  u32 addr;
   SP_READ(addr);
+  // the code being jumped to expects the clocks as the ROM left them
+  sp_exit();
   typedef void (*just_jump_t)(void);
   ((just_jump_t)addr)();
 }
 
-void serv_main() {
+static void serv_main() {
   while (1) {
     u8 cmd;
     SP_READ(cmd);
+    if (cmd == CMD_TAG) {
+      SP_READ(cur_cmd.tag);
+      cur_cmd.tagged = 1;
+      SP_READ(cmd);
+    }
+    STATS_CMD_BEGIN();
     switch (cmd) {
     case CMD_PING:
       send_ack(cmd, STATUS_OK);
       break;
+#ifdef SP_UART
+    case CMD_SET_BAUD:
+      do_set_baud(cmd);
+      break;
+#endif
     case CMD_READ:
     case CMD_WRITE:
       do_rw(cmd);
@@ -131,9 +760,77 @@ void serv_main() {
     case CMD_EXEC:
       do_exec();
       break;
+    case CMD_CALL:
+      do_call(cmd);
+      break;
+    case CMD_API:
+      do_api(cmd);
+      break;
+    case CMD_FLASH_ERASE:
+    case CMD_FLASH_PROGRAM:
+    case CMD_WRITE_STREAM:
+      do_stream(cmd);
+      break;
+    case CMD_FLASH_HASH:
+      do_flash_hash(cmd);
+      break;
+    case CMD_CRC:
+      do_crc(cmd);
+      break;
+    case CMD_WRITE_COMPRESSED:
+      do_write_compressed(cmd);
+      break;
+    case CMD_BATCH:
+      do_batch(cmd);
+      break;
+    case CMD_MEM_FILL:
+      do_mem_fill(cmd);
+      break;
+    case CMD_MEM_COPY:
+      do_mem_copy(cmd);
+      break;
+    case CMD_MEM_COMPARE:
+      do_mem_compare(cmd);
+      break;
+    case CMD_MEM_FIND:
+      do_mem_find(cmd);
+      break;
+    case CMD_CAPTURE:
+      do_capture(cmd);
+      break;
+#ifdef SP_STATS
+    case CMD_STATS:
+      do_stats(cmd);
+      break;
+    case CMD_STATS_RESET:
+      stats_reset();
+      send_ack(cmd, STATUS_OK);
+      break;
+#endif
     default:
       send_ack(cmd, STATUS_UNK_CMD);
       break;
     }
+    STATS_CMD_END(cmd);
+    cur_cmd.tagged = 0;
   }
 }
+
+SECTION(".init") void sram_entry() {
+#ifndef HOST_SIM
+  // ROM only loads the image, .bss is whatever was in sram before
+  extern u32 __bss_start[], __bss_end[];
+  u32 *p;
+  for (p = __bss_start; p < __bss_end; p++)
+    *p = 0;
+#endif
+  STATS_INIT();
+  sp_init();
+
+  // Ack the "finalize" cmd
+  // Fujitsu's code sends 0x31 here
+  u8 alive = SP_ALIVE;
+  sp_write(&alive, sizeof(alive));
+
+  serv_main();
+}
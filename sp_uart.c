@@ -0,0 +1,308 @@
+/*
+UART transport on the MFS channel the ROM talked on (make UART=1)
+
+Same interface as the usb transport in sp_xfer.c. Received bytes land at
+the pending read's destination, or in a ring while no read is pending.
+The ROM leaves the channel at UART_ROM_BAUD; the host then negotiates a
+faster rate with CMD_SET_BAUD, and a break puts the server back at
+UART_ROM_BAUD.
+*/
+
+#include "common.h"
+#include "clock.h"
+#include "cm3.h"
+#include "hw.h"
+#include "mem.h"
+#include "platform.h"
+#include "sp_xfer.h"
+#include "stats.h"
+
+#ifndef UART_CH
+#define UART_CH 0
+#endif
+// only channels 4-7 have the 16 byte fifos
+#ifndef UART_FIFO
+#define UART_FIFO (UART_CH >= 4)
+#endif
+#define UART_FIFO_LEN 16
+#define UART_ROM_BAUD 9600
+#define UART_RX_IRQN (7 + 2 * UART_CH)
+#define UART_TX_IRQN (8 + 2 * UART_CH)
+#define UART_IRQ_MASK (NVIC_BIT(UART_RX_IRQN) | NVIC_BIT(UART_TX_IRQN))
+
+OSTRUCT(fm3_mfs_uart_t, 0x1c)
+OFIELD(0x00, u8 SMR);
+OFIELD(0x01, u8 SCR);
+OFIELD(0x04, u8 ESCR);
+OFIELD(0x05, u8 SSR);
+OFIELD(0x08, u16 DR); // RDR/TDR
+OFIELD(0x0C, u16 BGR);
+OFIELD(0x14, u8 FCR0);
+OFIELD(0x15, u8 FCR1);
+OFIELD(0x18, u8 FBYTE1);
+OFIELD(0x19, u8 FBYTE2);
+OSTRUCT_END
+
+static volatile struct fm3_mfs_uart_t *const uart =
+    (struct fm3_mfs_uart_t * const)CAT(CAT(FM3_MFS, UART_CH), _UART_BASE);
+
+#define SCR_TXE (1 << 0)
+#define SCR_RXE (1 << 1)
+#define SCR_TIE (1 << 3)
+#define SCR_RIE (1 << 4)
+#define SSR_TBI (1 << 0)
+#define SSR_TDRE (1 << 1)
+#define SSR_RDRF (1 << 2)
+#define SSR_ORE (1 << 3)
+#define SSR_FRE (1 << 4)
+#define SSR_PE (1 << 5)
+#define SSR_REC (1 << 7)
+#define BGR_MASK 0x7fff
+// fifo1 sends, fifo2 receives (FCR1.FSEL = 0)
+#define FCR0_FE1 (1 << 0)
+#define FCR0_FE2 (1 << 1)
+#define FCR0_FCL1 (1 << 2)
+#define FCR0_FCL2 (1 << 3)
+
+#define RX_RING_LEN 256
+
+static struct {
+  u8 buf[RX_RING_LEN];
+  u32 rptr;
+  u32 wptr;
+} rx_ring;
+
+// Pending receive, bytes go here once the ring has been drained into it
+static struct {
+  u8 *buf;
+  u32 len;
+} rx_direct;
+
+// Pending send
+static struct {
+  u8 *buf;
+  u32 len;
+} tx_pending;
+
+// see sp_failed()
+static u8 xfer_failed;
+
+// clock the MFS runs from
+static u32 uart_pclk;
+static u16 uart_rom_bgr;
+
+static u32 uart_div(u32 baud) { return (uart_pclk + baud / 2) / baud; }
+
+int sp_baud_ok(u32 baud) {
+  u32 div, actual, err;
+  if (!baud)
+    return 0;
+  div = uart_div(baud);
+  if (div < 4 || div - 1 > BGR_MASK)
+    return 0;
+  actual = uart_pclk / div;
+  err = actual > baud ? actual - baud : baud - actual;
+  return err * 50 <= baud;
+}
+
+static void uart_set_bgr(u32 baud) {
+  u8 scr = uart->SCR;
+  uart->SCR = scr & ~(SCR_TXE | SCR_RXE);
+  uart->BGR = uart_div(baud) - 1;
+  uart->SCR = scr;
+}
+
+static u32 rx_ring_count() {
+  return (rx_ring.wptr - rx_ring.rptr) % RX_RING_LEN;
+}
+
+static int rx_room() {
+  return rx_direct.len || rx_ring_count() < RX_RING_LEN - 1;
+}
+
+static void rx_put(u8 c) {
+  if (rx_direct.len) {
+    *rx_direct.buf++ = c;
+    rx_direct.len--;
+  } else {
+    rx_ring.buf[rx_ring.wptr] = c;
+    rx_ring.wptr = (rx_ring.wptr + 1) % RX_RING_LEN;
+  }
+}
+
+static void uart_rx() {
+  u8 ssr = HW_RD8(&uart->SSR);
+  u32 n;
+
+  if (ssr & SSR_FRE) {
+    (void)HW_RD16(&uart->DR);
+    HW_WR8(&uart->SSR, SSR_REC);
+    // a break (or the host talking at another rate) puts us back at the
+    // ROM's rate
+    uart_set_bgr(UART_ROM_BAUD);
+    return;
+  }
+  n = UART_FIFO ? HW_RD8(&uart->FBYTE2) : !!(ssr & SSR_RDRF);
+  for (; n; n--) {
+    if (!rx_room()) {
+      // no room, the rest stays in the uart until the ring drains
+      STATS_INC(rx_stalls);
+      break;
+    }
+    rx_put(HW_RD16(&uart->DR));
+    STATS_INC(rx_bytes);
+  }
+  if (ssr & (SSR_ORE | SSR_PE)) {
+    // What made it into the uart goes first, then a stand-in for the byte
+    // an overrun lost (a parity error only damages its byte). The byte
+    // count stays in step with the host, the command acks NG.
+    if (n || !rx_room() || (HW_RD8(&uart->SSR) & SSR_RDRF) ||
+        (UART_FIFO && HW_RD8(&uart->FBYTE2)))
+      return;
+    HW_WR8(&uart->SSR, SSR_REC);
+    if (ssr & SSR_ORE)
+      rx_put(0);
+    xfer_failed = 1;
+    STATS_INC(xfer_errors);
+  }
+}
+
+static u32 uart_tx_room() {
+  if (UART_FIFO)
+    return UART_FIFO_LEN - HW_RD8(&uart->FBYTE1);
+  return !!(HW_RD8(&uart->SSR) & SSR_TDRE);
+}
+
+static void uart_tx() {
+  u32 n;
+  if (!tx_pending.len)
+    return;
+  n = uart_tx_room();
+  if (!n)
+    STATS_INC(tx_stalls);
+  if (n > tx_pending.len)
+    n = tx_pending.len;
+  STATS_ADD(tx_bytes, n);
+  tx_pending.len -= n;
+  while (n--)
+    HW_WR16(&uart->DR, *tx_pending.buf++);
+}
+
+void sp_poll() {
+  STATS_INC(polls);
+  uart_rx();
+  uart_tx();
+  HW_POLL();
+}
+
+static int uart_pending() {
+  u8 ssr = HW_RD8(&uart->SSR);
+  if (ssr & (SSR_RDRF | SSR_ORE | SSR_FRE | SSR_PE))
+    return 1;
+  if (UART_FIFO && HW_RD8(&uart->FBYTE2))
+    return 1;
+  return tx_pending.len && uart_tx_room();
+}
+
+// The MFS interrupts stay disabled in the NVIC, see usb_wait_init()
+void sp_wait() {
+  HW_WR32(&nvic->ICPR[UART_RX_IRQN / 32], UART_IRQ_MASK);
+  if (tx_pending.len)
+    uart->SCR |= SCR_TIE;
+  if (!uart_pending()) {
+    STATS_INC(sleeps);
+    HW_WAIT();
+  }
+  uart->SCR &= ~SCR_TIE;
+}
+
+void sp_read_start(u8 *buf, u16 len) {
+  u32 num_read = 0;
+  while (num_read < len && rx_ring.rptr != rx_ring.wptr) {
+    u32 end = rx_ring.wptr > rx_ring.rptr ? rx_ring.wptr : RX_RING_LEN;
+    u32 span = end - rx_ring.rptr;
+    if (span > len - num_read)
+      span = len - num_read;
+    mem_copy(buf + num_read, &rx_ring.buf[rx_ring.rptr], span);
+    rx_ring.rptr = (rx_ring.rptr + span) % RX_RING_LEN;
+    num_read += span;
+  }
+  rx_direct.buf = buf + num_read;
+  rx_direct.len = len - num_read;
+}
+
+int sp_read_done() {
+  if (rx_direct.len)
+    sp_poll();
+  return !rx_direct.len;
+}
+
+void sp_read(u8 *buf, u16 len) {
+  sp_read_start(buf, len);
+  while (!sp_read_done())
+    sp_wait();
+}
+
+void sp_write_start(u8 *buf, u16 len) {
+  tx_pending.buf = buf;
+  tx_pending.len = len;
+}
+
+int sp_write_done() {
+  sp_poll();
+  return !tx_pending.len;
+}
+
+int sp_failed() {
+  int failed = xfer_failed;
+  xfer_failed = 0;
+  return failed;
+}
+
+void sp_write(u8 *buf, u16 len) {
+  sp_write_start(buf, len);
+  while (!sp_write_done())
+    sp_wait();
+}
+
+void sp_set_baud(u32 baud) {
+  while (!sp_write_done())
+    ;
+  // wait for the shift register too, the ack has to go out at the old rate
+  while ((UART_FIFO && HW_RD8(&uart->FBYTE1)) ||
+         !(HW_RD8(&uart->SSR) & SSR_TBI))
+    HW_POLL();
+  uart_set_bgr(baud);
+}
+
+void sp_init() {
+  // the ROM set the channel up for UART_ROM_BAUD, which gives away the
+  // bus clock
+  uart_rom_bgr = uart->BGR;
+  uart_pclk = ((uart_rom_bgr & BGR_MASK) + 1) * UART_ROM_BAUD;
+#ifdef SP_CLOCK
+  if (clock_boost()) {
+    uart_pclk = CLOCK_APB_HZ;
+    uart_set_bgr(UART_ROM_BAUD);
+  }
+#endif
+  if (UART_FIFO) {
+    uart->FCR1 = 0;
+    uart->FCR0 = FCR0_FCL1 | FCR0_FCL2;
+    uart->FCR0 = FCR0_FE1 | FCR0_FE2;
+    // raise RDRF (and the rx interrupt) from the first byte on
+    uart->FBYTE2 = 1;
+  }
+  uart->SCR |= SCR_RIE;
+  HW_WR32(&nvic->ICER[UART_RX_IRQN / 32], UART_IRQ_MASK);
+  HW_WR32(scb_scr, HW_RD32(scb_scr) | SCR_SEVONPEND);
+}
+
+void sp_exit() {
+  sp_set_baud(UART_ROM_BAUD);
+  uart->SCR &= ~SCR_RIE;
+#ifdef SP_CLOCK
+  clock_restore();
+#endif
+  uart->BGR = uart_rom_bgr;
+}
@@ -1,11 +1,25 @@
 /*
 Replacement for Fujitsu's "serial programming mode" code loaded by ROM
+
+USB transport. The ROM has enumerated the device (a CDC serial port: EP1
+bulk out, EP2 bulk in, EP3 interrupt in) by the time we run; from then on
+everything is driven from the USB0 registers and state owned here, none
+of the ROM's usb state is used.
 */
 
 #include "common.h"
+#include "clock.h"
+#include "cm3.h"
+#include "dma.h"
+#include "hw.h"
+#include "mem.h"
 #include "platform.h"
+#include "stats.h"
+
+#define USB0_NUM_ENDPOINTS 6
 
 OSTRUCT(fm3_usb0_t, 0x78)
+OFIELD(0x24, u16 EP0C);
 OFIELD(0x40, u8 UDCS);
 OFIELD(0x44, u16 EP0IS);
 OFIELD(0x48, u16 EP0OS);
@@ -15,74 +29,124 @@ OSTRUCT_END
 volatile struct fm3_usb0_t *const usb0 =
     (struct fm3_usb0_t * const)FM3_USB0_BASE;
 
-/*
- Communication code is ripped from Fujitsu
- since it uses state setup by ROM...
-*/
+// EP1-5 registers are 16bit wide, one every 4 bytes
+static vu16 *usb0_epc(int ep_idx) {
+  return (vu16 *)(FM3_USB0_BASE + 0x24 + 4 * ep_idx);
+}
+static vu16 *usb0_eps(int ep_idx) {
+  return (vu16 *)(FM3_USB0_BASE + 0x48 + 4 * ep_idx);
+}
+static vu16 *usb0_epdt(int ep_idx) {
+  return (vu16 *)(FM3_USB0_BASE + 0x60 + 4 * ep_idx);
+}
 
-#define USB0_NUM_ENDPOINTS 6
+#define EPC_PKS_MASK 0x1ff
+#define EPC_STAL (1 << 9)
+#define EPC_EPEN (1 << 15)
+#define EPS_SIZE_MASK 0x1ff
+#define UDCS_SETP (1 << 1)
 
-struct usb_ep0_state_t {
-  void *buf_out;
-  void *buf_in;
-  u16 buf_out_len;
-  u16 field_A;
-  u8 field_C;
-  u8 field_D;
-  u8 field_E;
-  u8 field_F;
-  u8 field_10;
-} __attribute__((packed));
-ASSERT_STRSIZE(struct usb_ep0_state_t, 0x11);
-
-struct usb_ep_state_t {
-  u8 *buf_beg;
-  u8 *buf_end;
-  u8 *buf_rptr;
-  u8 *buf_wptr;
-  u8 field_10;
-  u8 field_11;
-  u8 field_12;
-  u8 field_13;
-  u16 len_pending;
-  u8 field_16;
-  u8 field_17;
-  u32 buf_len;
-  u16 len_max;
-  u8 ep_index;
-  u8 field_1F;
-  u8 field_20;
-  u8 mode;
-  u8 field_22;
-  u8 field_23;
-  u8 field_24;
-  u8 field_25;
-  u8 field_26;
-  u8 field_27;
-  vu16 *EPxC;
+// DRQ of EP1-5, and EP0 DRQI/DRQO plus bus status
+#define USB0F_IRQN 78
+#define USB0_IRQN 79
+#define USB0_IRQ_MASK (NVIC_BIT(USB0F_IRQN) | NVIC_BIT(USB0_IRQN))
+
+struct usb_ep_t {
   vu16 *EPxS;
   vu16 *EPxDT;
-  u8 field_34;
-  u8 _pad_35[3];
-} __attribute__((packed));
-ASSERT_STRSIZE(struct usb_ep_state_t, 0x38);
+  u16 len_max;
+  u16 len_pending;
+};
+
+static struct usb_ep_t usb_ep_out; // EP1
+static struct usb_ep_t usb_ep_in;  // EP2
 
-struct usb_ep_states_t {
-  struct usb_ep0_state_t *ep0;
-  struct usb_ep_state_t *epX[USB0_NUM_ENDPOINTS - 1];
+// endpoints enabled by the ROM, bit n is epn
+static u8 usb_ep_mask;
+
+/*
+ FIFO copy kernels. A 16bit access to EPxDT moves a halfword, a byte
+ access only moves the low byte and is used for an odd final byte.
+*/
+
+struct fifo_rd_t {
+  vu16 *dt;
+  u32 left; // bytes still in the fifo
+  u8 carry; // upper byte of a halfword split across destinations
+  u8 has_carry;
 };
 
-// Defined linker script
-extern struct usb_ep_states_t usb0_ep_states;
+static void fifo_rd_init(struct fifo_rd_t *f, vu16 *dt, u32 len) {
+  f->dt = dt;
+  f->left = len;
+  f->has_carry = 0;
+}
 
-static struct usb_ep0_state_t *get_usb0_ep0_state() {
-  return usb0_ep_states.ep0;
+// May be called several times to scatter one packet over multiple spans
+static void fifo_read(struct fifo_rd_t *f, u8 *dst, u32 len) {
+  vu16 *dt = f->dt;
+
+  if (len && f->has_carry) {
+    *dst++ = f->carry;
+    f->has_carry = 0;
+    len--;
+  }
+  f->left -= len & ~1;
+  if (!((u32)dst & 1)) {
+    if (len >= 2 && ((u32)dst & 2)) {
+      *(u16 *)dst = HW_RD16(dt);
+      dst += 2;
+      len -= 2;
+    }
+    for (; len >= 4; len -= 4, dst += 4) {
+      u32 lo = HW_RD16(dt);
+      u32 hi = HW_RD16(dt);
+      *(u32 *)dst = lo | (hi << 16);
+    }
+    if (len >= 2) {
+      *(u16 *)dst = HW_RD16(dt);
+      dst += 2;
+      len -= 2;
+    }
+  } else {
+    for (; len >= 2; len -= 2, dst += 2) {
+      u16 val = HW_RD16(dt);
+      dst[0] = val;
+      dst[1] = val >> 8;
+    }
+  }
+  if (len) {
+    if (f->left == 1) {
+      *dst = HW_RD8((vu8 *)dt);
+      f->left = 0;
+    } else {
+      u16 val = HW_RD16(dt);
+      *dst = val;
+      f->carry = val >> 8;
+      f->has_carry = 1;
+      f->left -= 2;
+    }
+  }
 }
 
-static struct usb_ep_state_t *get_usb0_epX_state(int ep_idx) {
-  return usb0_ep_states.epX[ep_idx - 1];
+static void fifo_write(vu16 *dt, const u8 *src, u32 len) {
+  if (!((u32)src & 1)) {
+    for (; len >= 4 && !((u32)src & 2); len -= 4, src += 4) {
+      u32 val = *(const u32 *)src;
+      HW_WR16(dt, val);
+      HW_WR16(dt, val >> 16);
+    }
+    for (; len >= 2; len -= 2, src += 2)
+      HW_WR16(dt, *(const u16 *)src);
+  } else {
+    for (; len >= 2; len -= 2, src += 2)
+      HW_WR16(dt, src[0] | (src[1] << 8));
+  }
+  if (len)
+    HW_WR8((vu8 *)dt, *src);
 }
 
+
 static int usb0_clear_interrupts() {
   int bus_reset = 0;
   if (!usb0->UDCS)
@@ -102,182 +166,515 @@ static int usb0_clear_interrupts() {
   return bus_reset;
 }
 
-static void usb0_ep0_xfer(struct usb_ep0_state_t *ep0) {
-  u16 *buf;
-  u32 len;
+/*
+ EP0: control requests which can show up once configured. Descriptors
+ belong to the ROM, so GET_DESCRIPTOR (and anything else unknown) is
+ stalled; a bus reset needs the ROM to enumerate again anyway.
+*/
 
-  if (usb0->EP0OS & 0x400) {
-    if (!(usb0->UDCS & 2)) {
-      len = usb0->EP0OS & 0x3F;
-      if (len) {
-        buf = ep0->buf_in;
-        while (len >= 2) {
-          *buf++ = usb0->EP0DT;
-          len -= 2;
-        }
-        if (len)
-          *(u8 *)buf = usb0->EP0DT;
-        ep0->buf_out_len = 0;
-        usb0->EP0IS |= 0x4000;
-      }
-      usb0->EP0OS &= ~0x400;
+struct usb_setup_t {
+  u8 bmRequestType;
+  u8 bRequest;
+  u16 wValue;
+  u16 wIndex;
+  u16 wLength;
+} __attribute__((packed));
+ASSERT_STRSIZE(struct usb_setup_t, 8);
+
+#define REQ_GET_STATUS 0x00
+#define REQ_CLEAR_FEATURE 0x01
+#define REQ_SET_FEATURE 0x03
+#define REQ_GET_CONFIGURATION 0x08
+#define REQ_SET_CONFIGURATION 0x09
+#define REQ_GET_INTERFACE 0x0a
+#define REQ_SET_INTERFACE 0x0b
+#define REQ_CDC_SET_LINE_CODING 0x20
+#define REQ_CDC_GET_LINE_CODING 0x21
+#define REQ_CDC_SET_CONTROL_LINE_STATE 0x22
+#define REQ_CDC_SEND_BREAK 0x23
+
+#define REQ_TYPE_MASK 0x60
+#define REQ_TYPE_STANDARD 0x00
+#define REQ_TYPE_CLASS 0x20
+#define REQ_RECIP_MASK 0x1f
+#define REQ_RECIP_ENDPOINT 0x02
+#define FEATURE_ENDPOINT_HALT 0
+
+static struct {
+  // control write waiting for its data stage
+  u8 out_req;
+  u8 line_coding[7];
+} ep0_state = {
+    .line_coding = {0x00, 0xc2, 0x01, 0x00, 0, 0, 8}, // 115200 8N1
+};
+
+static void usb0_ep0_send(const void *buf, u32 len) {
+  STATS_TIMER(t);
+  while (!(usb0->EP0IS & 0x400))
+    HW_POLL();
+  STATS_ADD_CYCLES(ep0_wait_cycles, t);
+  fifo_write(&usb0->EP0DT, buf, len);
+  usb0->EP0IS &= ~0x400;
+}
+
+static void usb0_ep0_stall() { usb0->EP0C |= EPC_STAL; }
+
+// Returns the endpoint's control register for endpoint addressed requests
+static vu16 *usb0_ep0_req_epc(const struct usb_setup_t *req) {
+  u32 ep_idx = req->wIndex & 0xf;
+  if ((req->bmRequestType & REQ_RECIP_MASK) != REQ_RECIP_ENDPOINT)
+    return 0;
+  if (!ep_idx || ep_idx >= USB0_NUM_ENDPOINTS)
+    return 0;
+  return usb0_epc(ep_idx);
+}
+
+static void usb0_ep0_setup(const struct usb_setup_t *req) {
+  u8 reply[2] = {0};
+  vu16 *epc = usb0_ep0_req_epc(req);
+
+  if ((req->bmRequestType & REQ_TYPE_MASK) == REQ_TYPE_CLASS) {
+    switch (req->bRequest) {
+    case REQ_CDC_SET_LINE_CODING:
+      ep0_state.out_req = req->bRequest;
+      return;
+    case REQ_CDC_GET_LINE_CODING:
+      usb0_ep0_send(ep0_state.line_coding,
+                    req->wLength < sizeof(ep0_state.line_coding)
+                        ? req->wLength
+                        : sizeof(ep0_state.line_coding));
+      return;
+    case REQ_CDC_SET_CONTROL_LINE_STATE:
+    case REQ_CDC_SEND_BREAK:
+      usb0_ep0_send(0, 0);
+      return;
     }
-    if (ep0->buf_out_len) {
-      while (!(usb0->EP0IS & 0x400))
-        ;
-      buf = ep0->buf_out;
-      for (len = ep0->buf_out_len; len >= 2; len -= 2) {
-        usb0->EP0DT = *buf++;
+  } else if ((req->bmRequestType & REQ_TYPE_MASK) == REQ_TYPE_STANDARD) {
+    switch (req->bRequest) {
+    case REQ_GET_STATUS:
+      if (epc)
+        reply[0] = !!(*epc & EPC_STAL);
+      usb0_ep0_send(reply, req->wLength < 2 ? req->wLength : 2);
+      return;
+    case REQ_CLEAR_FEATURE:
+    case REQ_SET_FEATURE:
+      if (epc && req->wValue == FEATURE_ENDPOINT_HALT) {
+        if (req->bRequest == REQ_SET_FEATURE)
+          *epc |= EPC_STAL;
+        else
+          *epc &= ~EPC_STAL;
       }
-      if (len)
-        *(u8 *)&usb0->EP0DT = *(u8 *)buf;
-      ep0->buf_out_len = 0;
-      usb0->EP0IS |= 0x4000;
+      usb0_ep0_send(0, 0);
+      return;
+    case REQ_GET_CONFIGURATION:
+      reply[0] = 1;
+      // fallthrough
+    case REQ_GET_INTERFACE:
+      usb0_ep0_send(reply, req->wLength ? 1 : 0);
+      return;
+    case REQ_SET_CONFIGURATION:
+    case REQ_SET_INTERFACE:
+      usb0_ep0_send(0, 0);
+      return;
     }
   }
+  usb0_ep0_stall();
 }
 
-static void usb0_epX_read(struct usb_ep_state_t *ep) {
-  int len;
-  u8 *pDT;
-  u32 space_avail;
-  int pos;
+static void usb0_ep0_xfer() {
+  u32 len = usb0->EP0OS & 0x7f;
+  u8 buf[8] __attribute__((aligned(4)));
+  struct fifo_rd_t f;
 
-  len = 0;
-  pDT = (u8 *)ep->EPxDT;
+  if (len > sizeof(buf))
+    len = sizeof(buf);
+  fifo_rd_init(&f, &usb0->EP0DT, len);
+  fifo_read(&f, buf, len);
+  usb0->EP0OS &= ~0x400;
 
-  if (ep->mode == 1) {
-    return;
+  if (usb0->UDCS & UDCS_SETP) {
+    usb0->UDCS &= ~UDCS_SETP;
+    ep0_state.out_req = 0;
+    if (len == sizeof(struct usb_setup_t))
+      usb0_ep0_setup((const struct usb_setup_t *)buf);
+    else
+      usb0_ep0_stall();
+  } else if (ep0_state.out_req == REQ_CDC_SET_LINE_CODING) {
+    // data stage, then the status stage
+    mem_copy(ep0_state.line_coding, buf,
+             len < sizeof(ep0_state.line_coding)
+                 ? len
+                 : sizeof(ep0_state.line_coding));
+    ep0_state.out_req = 0;
+    usb0_ep0_send(0, 0);
   }
+  // anything else is the status stage of a control read
+}
 
-  if (ep->mode == 2) {
-    if (ep->buf_rptr < ep->buf_wptr) {
-      space_avail = (u32)ep->buf_rptr + ep->buf_len - (u32)ep->buf_wptr;
-    } else {
-      space_avail = ep->buf_rptr - ep->buf_wptr;
-      if (space_avail == 0)
-        space_avail = ep->buf_len;
-    }
-    len = space_avail - 1;
-    // checkout EPxS.SIZEx
-    if (len >= *(u8 *)ep->EPxS) {
-      if (len > *(u8 *)ep->EPxS)
-        len = *(u8 *)ep->EPxS;
-      ep->len_pending = len;
-      pos = 0;
-      while (len >= 1) {
-        *ep->buf_wptr++ = pDT[pos & 1];
-        if (ep->buf_wptr > ep->buf_end)
-          ep->buf_wptr = ep->buf_beg;
-        --len;
-        ++pos;
-      }
-    }
+// Pending receive. Once the ring has been drained into it, further
+// packets land here directly instead of going through the ring.
+static struct {
+  u8 *buf;
+  u32 len;
+} rx_direct;
+
+// Pending send, pushed out packet by packet from sp_poll()
+static struct {
+  u8 *buf;
+  u32 len;
+} tx_pending;
+
+// see sp_failed()
+static u8 xfer_failed;
+
+// Packets arriving while no read is pending. Several packets deep so the
+// host can keep streaming while the server is busy with a command.
+#define RX_RING_LEN 1024
+
+static struct {
+  u8 buf[RX_RING_LEN];
+  u32 rptr;
+  u32 wptr;
+} rx_ring;
+
+static u32 rx_ring_space() {
+  return RX_RING_LEN - 1 - (rx_ring.wptr - rx_ring.rptr) % RX_RING_LEN;
+}
+
+#ifdef SP_DMA
+/*
+ Optional DMAC backend: packets moved in their entirety to/from memory
+ are handed to a dma channel instead of being copied by the cpu.
+ EPxS.DRQ is only released once the channel is done.
+*/
+
+#define DMA_CH_RX 0
+#define DMA_CH_TX 1
+// below this the cpu is quicker than setting up the channel
+#define DMA_MIN_LEN 16
+
+static struct {
+  u32 rx_len;
+  u8 tx_busy;
+  const u8 *tx_buf; // for redoing a failed send
+} xfer_dma;
+
+static int dma_usable(const u8 *buf, u32 len) {
+  return len >= DMA_MIN_LEN && !(((u32)buf | len) & 1);
+}
+
+// A failed transfer is redone by the cpu, which keeps the stream in step
+// with the host. It may have moved part of the packet already, so the
+// command still acks NG.
+static void dma_failed() {
+  xfer_failed = 1;
+  STATS_INC(xfer_errors);
+}
+
+// Nonzero once the packet being sent is out of the caller's buffer
+static int usb_tx_dma_done(struct usb_ep_t *ep) {
+  int rv;
+  if (!xfer_dma.tx_busy)
+    return 1;
+  rv = dma_poll(DMA_CH_TX);
+  if (rv == DMA_BUSY)
+    return 0;
+  if (rv == DMA_ERROR) {
+    dma_failed();
+    fifo_write(ep->EPxDT, xfer_dma.tx_buf, ep->len_pending);
   }
+  xfer_dma.tx_busy = 0;
+  return 1;
+}
+#endif
 
-  if (len) {
-    *ep->EPxS &= ~0x4000;
-    // dword_20003008 = ep;
+
+// Drains len bytes from the fifo into the ring, in at most two spans
+static void ring_fill(struct fifo_rd_t *f, u32 len) {
+  u32 span = RX_RING_LEN - rx_ring.wptr;
+
+  if (len < span) {
+    fifo_read(f, &rx_ring.buf[rx_ring.wptr], len);
+    rx_ring.wptr += len;
   } else {
+    fifo_read(f, &rx_ring.buf[rx_ring.wptr], span);
+    fifo_read(f, rx_ring.buf, len - span);
+    rx_ring.wptr = len - span;
+  }
+}
+
+static void usb0_epX_read(struct usb_ep_t *ep) {
+  struct fifo_rd_t f;
+  u32 size;
+  u32 direct;
+
+#ifdef SP_DMA
+  if (xfer_dma.rx_len) {
+    int rv = dma_poll(DMA_CH_RX);
+    if (rv == DMA_BUSY)
+      return;
+    if (rv == DMA_ERROR) {
+      dma_failed();
+      fifo_rd_init(&f, ep->EPxDT, xfer_dma.rx_len);
+      fifo_read(&f, rx_direct.buf, xfer_dma.rx_len);
+    }
+    rx_direct.buf += xfer_dma.rx_len;
+    rx_direct.len -= xfer_dma.rx_len;
+    xfer_dma.rx_len = 0;
     *ep->EPxS &= ~0x0400;
+    return;
+  }
+#endif
+
+  // checkout EPxS.SIZEx
+  size = *ep->EPxS & EPS_SIZE_MASK;
+  direct = size < rx_direct.len ? size : rx_direct.len;
+  // only what doesn't fit the pending receive has to go into the ring
+  if (rx_ring_space() < size - direct) {
+    // no room, the packet stays in the fifo until the ring drains
+    STATS_INC(rx_stalls);
+    return;
   }
+#ifdef SP_DMA
+  if (direct == size && dma_usable(rx_direct.buf, size)) {
+    dma_start(DMA_CH_RX, ep->EPxDT, rx_direct.buf, size / 2,
+              DMA_WIDTH_16 | DMA_FIXED_SRC);
+    xfer_dma.rx_len = size;
+    STATS_ADD(rx_bytes, size);
+    return;
+  }
+#endif
+  STATS_TIMER(t);
+  fifo_rd_init(&f, ep->EPxDT, size);
+  if (direct) {
+    fifo_read(&f, rx_direct.buf, direct);
+    rx_direct.buf += direct;
+    rx_direct.len -= direct;
+  }
+  ring_fill(&f, size - direct);
+  STATS_ADD_CYCLES(fifo_rd_cycles, t);
+  STATS_ADD(rx_bytes, size);
+  *ep->EPxS &= ~0x0400;
+}
+
+static void usb0_epX_write_done(struct usb_ep_t *ep) {
+  // DRQ just means the fifo is free until a packet has been written
+  if (!ep->len_pending)
+    return;
+#ifdef SP_DMA
+  if (!usb_tx_dma_done(ep))
+    return;
+#endif
+  *ep->EPxS &= ~0x400;
+  ep->len_pending = 0;
 }
 
+// Both bulk endpoints are serviced on every pass, so a command's reply can
+// go out while the host is already sending the next one.
 static int usb_sync_buffers() {
   int bus_reset = usb0_clear_interrupts();
+  STATS_INC(polls);
   if (!bus_reset) {
     int ep_idx;
-    usb0_ep0_xfer(get_usb0_ep0_state());
+    if (usb0->EP0OS & 0x400)
+      usb0_ep0_xfer();
     for (ep_idx = 1; ep_idx < USB0_NUM_ENDPOINTS; ++ep_idx) {
-      struct usb_ep_state_t *ep;
-      ep = get_usb0_epX_state(ep_idx);
-      if (ep->field_22 == 3) {
-        if ((*ep->EPxS & 0x8200) == 0x200)
-          *ep->EPxS &= ~0x200;
-        if (*ep->EPxS & 0x400) {
-          if (ep_idx == 2) {
-            *ep->EPxS &= ~0x400;
-            if (ep->len_pending)
-              ep->len_pending = 0;
-          } else if (ep_idx == 3) {
-            *ep->EPxS &= ~0x400;
-          } else {
-            usb0_epX_read(ep);
-          }
-        }
-      }
+      vu16 *eps = usb0_eps(ep_idx);
+      u16 epxs;
+      if (!(usb_ep_mask & (1 << ep_idx)))
+        continue;
+      epxs = *eps;
+      if ((epxs & 0x8200) == 0x200)
+        *eps &= ~0x200;
+      if (!(epxs & 0x400))
+        continue;
+      if (ep_idx == 1)
+        usb0_epX_read(&usb_ep_out);
+      else if (ep_idx == 2)
+        usb0_epX_write_done(&usb_ep_in);
+      else if (ep_idx == 3)
+        *eps &= ~0x400;
     }
   }
+  HW_POLL();
   return bus_reset;
 }
 
-static u32 usb_read(struct usb_ep_state_t *ep, u8 *buf, u32 len) {
-  u8 *rptr;
+// Anything for usb_sync_buffers() to act on. EP3 (notifications) is
+// deliberately left out, it never carries data for us.
+static int usb_pending() {
+  // the bits usb0_clear_interrupts() acks
+  if ((usb0->UDCS & 0x3d) || (usb0->EP0OS & 0x400))
+    return 1;
+  if (*usb_ep_out.EPxS & 0x400)
+    return 1;
+  return (*usb_ep_in.EPxS & 0x400) &&
+         (usb_ep_in.len_pending || tx_pending.len);
+}
+
+/*
+ Sleeping until the host does something. The ROM's vector table is still
+ in charge, so the usb interrupts stay disabled in the NVIC; with
+ SCR.SEVONPEND them becoming pending still wakes WFE. Pending is cleared
+ before looking at the endpoints, anything arriving after that sets the
+ event register and WFE falls through.
+*/
+
+static void usb_wait_init() {
+  int ep_idx;
+  for (ep_idx = 1; ep_idx < USB0_NUM_ENDPOINTS; ++ep_idx) {
+    vu16 *eps = usb0_eps(ep_idx);
+    if (!(*usb0_epc(ep_idx) & EPC_EPEN))
+      continue;
+    usb_ep_mask |= 1 << ep_idx;
+    // DRQIE: EP1 wakes us on every packet. The IN endpoints' DRQ is set
+    // whenever their fifo is free, EP2's is only enabled while waiting to
+    // send.
+    if (ep_idx == 1)
+      *eps |= 0x4000;
+    else
+      *eps &= ~0x4000;
+  }
+  usb0->EP0OS |= 0x4000;
+  HW_WR32(&nvic->ICER[USB0_IRQN / 32], USB0_IRQ_MASK);
+  HW_WR32(scb_scr, HW_RD32(scb_scr) | SCR_SEVONPEND);
+}
+
+void sp_wait() {
+#ifdef SP_DMA
+  // dma completion doesn't raise an event
+  if (xfer_dma.rx_len || xfer_dma.tx_busy)
+    return;
+#endif
+  HW_WR32(&nvic->ICPR[USB0_IRQN / 32], USB0_IRQ_MASK);
+  if (tx_pending.len)
+    *usb_ep_in.EPxS |= 0x4000;
+  if (!usb_pending()) {
+    STATS_INC(sleeps);
+    HW_WAIT();
+  }
+  if (tx_pending.len)
+    *usb_ep_in.EPxS &= ~0x4000;
+}
+
+static u32 usb_read(u8 *buf, u32 len) {
   u32 num_read;
+  u32 span;
 
-  if (!ep->field_34)
-    return 0;
-  if (ep->mode != 2)
-    return 0;
-  rptr = ep->buf_rptr;
-  for (num_read = 0; num_read < len && rptr != ep->buf_wptr; ++num_read) {
-    *buf++ = *rptr++;
-    if (rptr > ep->buf_end)
-      rptr = ep->buf_beg;
+  for (num_read = 0; num_read < len && rx_ring.rptr != rx_ring.wptr;
+       num_read += span) {
+    u32 end = rx_ring.wptr > rx_ring.rptr ? rx_ring.wptr : RX_RING_LEN;
+    span = end - rx_ring.rptr;
+    if (span > len - num_read)
+      span = len - num_read;
+    mem_copy(buf + num_read, &rx_ring.buf[rx_ring.rptr], span);
+    rx_ring.rptr = (rx_ring.rptr + span) % RX_RING_LEN;
   }
-  ep->buf_rptr = rptr;
   return num_read;
 }
 
-static u32 usb_write(struct usb_ep_state_t *ep, u8 *buf, u32 len) {
-  u8 *pDT;
-  u32 num_written;
-  u32 pos;
-
-  if (ep->len_pending)
+static u32 usb_write(struct usb_ep_t *ep, u8 *buf, u32 len) {
+  if (ep->len_pending || !(*ep->EPxS & 0x400)) {
+    STATS_INC(tx_stalls);
     return 0;
-  if (!(*ep->EPxS & 0x400))
-    return 0;
-  pDT = (u8 *)ep->EPxDT;
+  }
   if (len >= ep->len_max)
     len = ep->len_max;
-  num_written = len;
-  pos = 0;
-  while (len >= 1) {
-    pDT[pos & 1] = *buf++;
-    --len;
-    ++pos;
+  STATS_ADD(tx_bytes, len);
+#ifdef SP_DMA
+  if (dma_usable(buf, len)) {
+    dma_start(DMA_CH_TX, buf, ep->EPxDT, len / 2,
+              DMA_WIDTH_16 | DMA_FIXED_DST);
+    xfer_dma.tx_busy = 1;
+    xfer_dma.tx_buf = buf;
+  } else
+#endif
+  {
+    STATS_TIMER(t);
+    fifo_write(ep->EPxDT, buf, len);
+    STATS_ADD_CYCLES(fifo_wr_cycles, t);
   }
-  ep->len_pending = num_written;
-  return num_written;
+  ep->len_pending = len;
+  return len;
 }
 
-static int usb_xfer(u8 *buf, u16 len, int is_write) {
-  u32 rem;
-  u32 num_xfer;
+// Reads complete in the background (progressed by sp_poll()): whatever is
+// already in the ring is copied out, the rest lands at buf directly.
+void sp_read_start(u8 *buf, u16 len) {
+  u32 num_read = usb_read(buf, len);
+  rx_direct.buf = buf + num_read;
+  rx_direct.len = len - num_read;
+}
 
-  for (rem = len;; rem -= num_xfer) {
+int sp_read_done() {
+  if (rx_direct.len)
     usb_sync_buffers();
-    num_xfer = is_write ? usb_write(get_usb0_epX_state(2), buf, rem)
-                        : usb_read(get_usb0_epX_state(1), buf, rem);
-    if (num_xfer >= rem)
-      break;
-    buf += num_xfer;
+  return !rx_direct.len;
+}
+
+void sp_read(u8 *buf, u16 len) {
+  sp_read_start(buf, len);
+  while (!sp_read_done())
+    sp_wait();
+}
+
+void sp_poll() {
+  usb_sync_buffers();
+  if (tx_pending.len) {
+    u32 num_written = usb_write(&usb_ep_in, tx_pending.buf, tx_pending.len);
+    tx_pending.buf += num_written;
+    tx_pending.len -= num_written;
   }
+}
+
+// Sends complete in the background as well, the caller may do other work
+// (as long as buf stays untouched) and poll for completion.
+void sp_write_start(u8 *buf, u16 len) {
+  tx_pending.buf = buf;
+  tx_pending.len = len;
+}
+
+int sp_write_done() {
+  sp_poll();
+#ifdef SP_DMA
+  // the last packet may still be on its way out of buf
+  if (!tx_pending.len && !usb_tx_dma_done(&usb_ep_in))
+    return 0;
+#endif
+  return !tx_pending.len;
+}
+
+int sp_failed() {
+  int failed = xfer_failed;
+  xfer_failed = 0;
+  return failed;
+}
+
+void sp_write(u8 *buf, u16 len) {
+  sp_write_start(buf, len);
+  while (!sp_write_done())
+    sp_wait();
   usb_sync_buffers();
-  return 0;
 }
 
-void sp_read(u8 *buf, u16 len) { usb_xfer(buf, len, 0); }
-void sp_write(u8 *buf, u16 len) { usb_xfer(buf, len, 1); }
+static void usb_ep_init(struct usb_ep_t *ep, int ep_idx) {
+  ep->EPxS = usb0_eps(ep_idx);
+  ep->EPxDT = usb0_epdt(ep_idx);
+  ep->len_max = *usb0_epc(ep_idx) & EPC_PKS_MASK;
+  ep->len_pending = 0;
+}
 
-__attribute__((section(".init"))) void sram_entry() {
-  // Ack the "finalize" cmd
-  // Fujitsu's code sends 0x31 here
-  u8 alive = 0xA1;
-  sp_write(&alive, sizeof(alive));
+void sp_init() {
+#ifdef SP_CLOCK
+  clock_boost();
+#endif
+  usb_ep_init(&usb_ep_out, 1);
+  usb_ep_init(&usb_ep_in, 2);
+  usb_wait_init();
+}
 
-  // do the real stuff
-  extern void serv_main();
-  serv_main();
+void sp_exit() {
+#ifdef SP_CLOCK
+  clock_restore();
+#endif
 }
@@ -1,4 +1,39 @@
 #pragma once
 
+// Transport to the host, implemented by sp_xfer.c (usb) or sp_uart.c
+
+// brings up the transport (and the clocks it runs from)
+void sp_init();
+// undoes sp_init() before handing the chip to other code
+void sp_exit();
+
 void sp_read(u8 *buf, u16 len);
 void sp_write(u8 *buf, u16 len);
+void sp_poll();
+// sleeps until there is work for sp_poll() and friends
+void sp_wait();
+void sp_read_start(u8 *buf, u16 len);
+int sp_read_done();
+void sp_write_start(u8 *buf, u16 len);
+int sp_write_done();
+// nonzero if data was lost or damaged on the way since the last call, the
+// command running at the time then acks NG
+int sp_failed();
+
+// blocking transfers of a whole object
+#define SP_READ(x)                                                             \
+  do {                                                                         \
+    sp_read((void *)&(x), sizeof(x));                                          \
+  } while (0)
+
+#define SP_WRITE(x)                                                            \
+  do {                                                                         \
+    sp_write((void *)&(x), sizeof(x));                                         \
+  } while (0)
+
+#ifdef SP_UART
+// nonzero if baud can be hit within 2%
+int sp_baud_ok(u32 baud);
+// switches once everything queued has gone out
+void sp_set_baud(u32 baud);
+#endif
@@ -0,0 +1,151 @@
+/*
+First stage loader (stage1.bin, see stage1.ld)
+
+The ROM loads this to the start of sram1 like it would the server. It
+copies itself to sram0, brings up the fast transport and takes the server
+image compressed with CMD_WRITE_COMPRESSED, then CMD_EXEC starts it. Only
+the ROM's slow protocol has to carry this, so startup time no longer grows
+with the server.
+*/
+
+#include "common.h"
+#include "crc.h"
+#include "hw.h"
+#include "lz.h"
+#include "sp_cmd.h"
+#include "sp_xfer.h"
+
+static u8 comp_buf[STREAM_BLOCK] __attribute__((aligned(4)));
+
+static void send_ack(u8 cmd, u8 status) {
+  u8 ack;
+  if (sp_failed() && status == STATUS_OK)
+    status = STATUS_NG;
+  ack = (cmd & 0xf0) | status;
+  SP_WRITE(ack);
+}
+
+// Takes len bytes from the host and drops them
+static void skip_input(u32 len) {
+  while (len) {
+    u16 num = len > STREAM_BLOCK ? STREAM_BLOCK : len;
+    sp_read(comp_buf, num);
+    len -= num;
+  }
+}
+
+// Blocks are decoded straight to their destination, which must not be
+// this image. Like the server, every declared block is taken even after an
+// error, so the ack comes where the host expects it.
+static void do_write_compressed(u8 cmd) {
+  extern u32 __stage1_start[], __bss_end[];
+  struct stream_args_t args;
+  struct lz_block_t blk;
+  u8 status = STATUS_OK;
+  SP_READ(args);
+
+  if (args.addr < (u32)__bss_end && args.addr + args.len > (u32)__stage1_start)
+    status = STATUS_NG;
+  while (args.len) {
+    u8 *dst = (u8 *)args.addr;
+    SP_READ(blk);
+    if (!blk.raw_len || blk.raw_len > args.len ||
+        blk.raw_len > STREAM_BLOCK || blk.comp_len > STREAM_BLOCK)
+      status = STATUS_NG;
+    if (status != STATUS_OK) {
+      skip_input(blk.comp_len);
+      if (!blk.raw_len)
+        break;
+      args.len -= blk.raw_len < args.len ? blk.raw_len : args.len;
+      continue;
+    }
+    if (blk.comp_len == blk.raw_len) {
+      sp_read(dst, blk.raw_len);
+    } else if (blk.comp_len) {
+      sp_read(comp_buf, blk.comp_len);
+      if (lz4_decode(dst, blk.raw_len, comp_buf, blk.comp_len) != blk.raw_len)
+        status = STATUS_NG;
+    }
+    args.addr += blk.raw_len;
+    args.len -= blk.raw_len;
+  }
+  send_ack(cmd, status);
+}
+
+static void do_crc(u8 cmd) {
+  struct stream_args_t args;
+  u32 crc;
+  SP_READ(args);
+  crc = crc32((u8 *)args.addr, args.len);
+  SP_WRITE(crc);
+  send_ack(cmd, STATUS_OK);
+}
+
+#ifdef SP_UART
+static void do_set_baud(u8 cmd) {
+  u32 baud;
+  SP_READ(baud);
+  if (!sp_baud_ok(baud)) {
+    send_ack(cmd, STATUS_NG);
+    return;
+  }
+  send_ack(cmd, STATUS_OK);
+  sp_set_baud(baud);
+}
+#endif
+
+// The server starts over with sp_init() and acks with SP_ALIVE
+static void do_exec() {
+  u32 addr;
+  SP_READ(addr);
+  sp_exit();
+  typedef void (*just_jump_t)(void);
+  ((just_jump_t)addr)();
+}
+
+// kept out of .init, which the server gets loaded over
+static void __attribute__((noinline)) stage1_main() {
+  u8 alive = SP_ALIVE;
+  sp_init();
+  SP_WRITE(alive);
+
+  while (1) {
+    u8 cmd;
+    SP_READ(cmd);
+    switch (cmd) {
+    case CMD_PING:
+      send_ack(cmd, STATUS_OK);
+      break;
+#ifdef SP_UART
+    case CMD_SET_BAUD:
+      do_set_baud(cmd);
+      break;
+#endif
+    case CMD_WRITE_COMPRESSED:
+      do_write_compressed(cmd);
+      break;
+    case CMD_CRC:
+      do_crc(cmd);
+      break;
+    case CMD_EXEC:
+      do_exec();
+      break;
+    default:
+      send_ack(cmd, STATUS_UNK_CMD);
+      break;
+    }
+  }
+}
+
+// Runs where the ROM put it, everything else is linked for sram0
+SECTION(".init") void stage1_entry() {
+  extern u32 __stage1_load[], __stage1_start[], __stage1_end[];
+  extern u32 __bss_start[], __bss_end[];
+  u32 *src = __stage1_load;
+  u32 *p;
+  for (p = __stage1_start; p < __stage1_end; p++)
+    *p = *src++;
+  for (p = __bss_start; p < __bss_end; p++)
+    *p = 0;
+  stage1_main();
+}
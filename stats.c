@@ -0,0 +1,64 @@
+/*
+Cycle/byte accounting for the transport and per command
+*/
+
+#include "common.h"
+#include "cm3.h"
+#include "hw.h"
+#include "stats.h"
+
+struct stats_t sp_stats;
+
+static struct {
+  u32 cycles;
+  u32 bytes;
+} cmd_start;
+
+void stats_init() {
+  HW_WR32(&dwt->CYCCNT, 0);
+  cm3_cycles_enable();
+}
+
+void stats_reset() {
+  u8 *p = (u8 *)&sp_stats;
+  u32 i;
+  for (i = 0; i < sizeof(sp_stats); i++)
+    p[i] = 0;
+  // the running command counts from here on
+  cmd_start.bytes = 0;
+}
+
+void stats_cmd_begin() {
+  cmd_start.bytes = sp_stats.rx_bytes + sp_stats.tx_bytes;
+  cmd_start.cycles = stats_cycles();
+}
+
+static u32 stats_bucket(u32 cycles) {
+  // bit length, 10 bits go into the first bucket, then 2 per bucket
+  u32 len = 32 - __builtin_clz(cycles | 1);
+  u32 b = len <= 10 ? 0 : (len - 9) / 2;
+  return b < STATS_HIST_BUCKETS ? b : STATS_HIST_BUCKETS - 1;
+}
+
+void stats_cmd_end(u8 cmd) {
+  u32 cycles = stats_cycles() - cmd_start.cycles;
+  struct stats_cmd_t *c = sp_stats.cmds;
+  struct stats_cmd_t *last = &sp_stats.cmds[STATS_NUM_CMDS - 1];
+  u32 b = stats_bucket(cycles);
+
+  // slots are handed out in order of first use, the last one collects
+  // whatever doesn't fit
+  while (c < last && c->count && c->cmd != cmd)
+    c++;
+  if (!c->count)
+    c->cmd = cmd;
+  else if (c->cmd != cmd)
+    c->cmd = STATS_CMD_OTHER;
+  c->count++;
+  c->cycles += cycles;
+  if (cycles > c->max_cycles)
+    c->max_cycles = cycles;
+  c->bytes += sp_stats.rx_bytes + sp_stats.tx_bytes - cmd_start.bytes;
+  if (c->hist[b] != 0xffff)
+    c->hist[b]++;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+/*
+ Hot path instrumentation using the DWT cycle counter. Only built with
+ SP_STATS (make STATS=1), otherwise every hook compiles to nothing.
+*/
+
+#define STATS_NUM_CMDS 16
+// bucket i counts commands which took < 1K << 2i cycles, the last one
+// takes everything else
+#define STATS_HIST_BUCKETS 8
+// cmd of the overflow slot once several commands share it
+#define STATS_CMD_OTHER 0xff
+
+struct stats_cmd_t {
+  u64 cycles;
+  u32 count;
+  u32 max_cycles;
+  u32 bytes;
+  u16 hist[STATS_HIST_BUCKETS];
+  u8 cmd;
+  u8 _pad[3];
+} __attribute__((packed));
+ASSERT_STRSIZE(struct stats_cmd_t, 0x28);
+
+// sent as is in reply to CMD_STATS
+struct stats_t {
+  u32 polls;     // usb_sync_buffers() calls
+  u32 rx_bytes;
+  u32 tx_bytes;
+  u32 rx_stalls; // polls finding no room in the ring for a packet
+  u32 tx_stalls; // polls finding the previous packet still in flight
+  u32 ep0_wait_cycles;
+  u32 fifo_rd_cycles;
+  u32 fifo_wr_cycles;
+  u32 sleeps;      // times sp_wait() found nothing to do
+  u32 xfer_errors; // data lost or damaged, see sp_failed()
+  struct stats_cmd_t cmds[STATS_NUM_CMDS];
+} __attribute__((packed));
+ASSERT_STRSIZE(struct stats_t, 0x28 + 0x28 * STATS_NUM_CMDS);
+
+#ifdef SP_STATS
+#include "hw.h"
+
+#define DWT_CYCCNT ((vu32 *)0xE0001004)
+
+extern struct stats_t sp_stats;
+
+void stats_init();
+void stats_reset();
+void stats_cmd_begin();
+void stats_cmd_end(u8 cmd);
+
+static inline u32 stats_cycles() { return HW_RD32(DWT_CYCCNT); }
+
+#define STATS_INIT() stats_init()
+#define STATS_INC(field) (sp_stats.field++)
+#define STATS_ADD(field, n) (sp_stats.field += (n))
+#define STATS_TIMER(t) u32 t = stats_cycles()
+#define STATS_ADD_CYCLES(field, t) (sp_stats.field += stats_cycles() - (t))
+#define STATS_CMD_BEGIN() stats_cmd_begin()
+#define STATS_CMD_END(cmd) stats_cmd_end(cmd)
+#else
+#define STATS_INIT() ((void)0)
+#define STATS_INC(field) ((void)0)
+#define STATS_ADD(field, n) ((void)0)
+#define STATS_TIMER(t) ((void)0)
+#define STATS_ADD_CYCLES(field, t) ((void)0)
+#define STATS_CMD_BEGIN() ((void)0)
+#define STATS_CMD_END(cmd) ((void)0)
+#endif